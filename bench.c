@@ -0,0 +1,734 @@
+// Jack Tarantino - jtarant3
+// Weina Dai - wdai11
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "io.h"
+#include "wave.h"
+#include "mix.h"
+#include "song.h"
+#include "resample.h"
+#include "delay.h"
+#include "convolve.h"
+#include <math.h>
+
+#define BENCH_SECONDS   10u    // Length of the synthetic workloads in seconds
+#define BENCH_FRAMES    (BENCH_SECONDS * SAMPLES_PER_SECOND)
+#define BENCH_WARMUP    1u     // Untimed runs before each case
+#define BENCH_RUNS      7u     // Default number of timed runs per case
+#define BENCH_MAX_RUNS  101u   // Most timed runs per case
+#define BENCH_MAX_CASES 128u   // Most cases in one suite
+#define BENCH_THRESHOLD 10.0   // Default regression threshold in percent
+#define BENCH_NAME      48     // Longest case name, with the terminator
+
+/* summary of the timed runs of one case */
+typedef struct {
+  char name[BENCH_NAME];
+  double median;       /* seconds */
+  double p10;          /* 10th percentile, seconds */
+  double p90;          /* 90th percentile, seconds */
+} BenchResult;
+
+static BenchResult results[BENCH_MAX_CASES];
+static unsigned num_results = 0;
+static unsigned bench_runs = BENCH_RUNS;
+
+/*
+ * This function returns the current value of the monotonic
+ * clock in seconds.
+ */
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/*
+ * This function orders two doubles for qsort.
+ */
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * This function returns the p-th quantile (0 to 1) of n sorted
+ * values, interpolating between the nearest two.
+ */
+static double quantile(const double sorted[], unsigned n, double p) {
+  double at = p * (n - 1);
+  unsigned below = (unsigned) at;
+  if (below + 1 >= n) {
+    return sorted[n - 1];
+  }
+  return sorted[below] + (at - below) * (sorted[below + 1] - sorted[below]);
+}
+
+/*
+ * This function times one case: it runs fn(arg) BENCH_WARMUP times
+ * untimed, so caches, page tables and branch predictors are warm,
+ * then bench_runs times timed, and records and prints the median and
+ * the 10th and 90th percentile. items is the work one run does, in
+ * the given unit (for example frames or bytes), for the rate column.
+ */
+static void bench_case(const char *name, void (*fn)(void *), void *arg,
+                       double items, const char *unit) {
+  double times[BENCH_MAX_RUNS];
+
+  if (num_results == BENCH_MAX_CASES) {
+    fatal_error("Too many benchmark cases");
+  }
+
+  for (unsigned i = 0; i < BENCH_WARMUP; i++) {
+    fn(arg);
+  }
+  for (unsigned i = 0; i < bench_runs; i++) {
+    double start = now_seconds();
+    fn(arg);
+    times[i] = now_seconds() - start;
+  }
+  qsort(times, bench_runs, sizeof(double), compare_doubles);
+
+  BenchResult *result = &results[num_results++];
+  snprintf(result->name, sizeof(result->name), "%s", name);
+  result->median = quantile(times, bench_runs, 0.5);
+  result->p10 = quantile(times, bench_runs, 0.1);
+  result->p90 = quantile(times, bench_runs, 0.9);
+
+  printf("%-34s %10.4f %10.4f %10.4f %10.1f %s\n", result->name, result->median,
+         result->p10, result->p90, items / result->median / 1e6, unit);
+}
+
+/*
+ * This function writes every result to a baseline file, one case per
+ * line as the name, a tab and the median in seconds.
+ */
+static void write_baseline(const char *path) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    fatal_error("Cannot open baseline file for writing");
+  }
+  fprintf(out, "# bench baseline: case<TAB>median seconds\n");
+  for (unsigned i = 0; i < num_results; i++) {
+    fprintf(out, "%s\t%.9f\n", results[i].name, results[i].median);
+  }
+  if (fclose(out) != 0) {
+    fatal_error("Cannot write baseline file");
+  }
+  printf("wrote baseline %s\n", path);
+}
+
+/*
+ * This function compares every result with a baseline file and
+ * prints the change of each case's median, flagging cases that got
+ * slower by more than threshold percent. Returns the number of
+ * regressions.
+ */
+static unsigned compare_baseline(const char *path, double threshold) {
+  FILE *in = fopen(path, "r");
+  if (in == NULL) {
+    fatal_error("Cannot open baseline file");
+  }
+
+  char names[BENCH_MAX_CASES][BENCH_NAME];
+  double medians[BENCH_MAX_CASES];
+  unsigned num_base = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), in) != NULL && num_base < BENCH_MAX_CASES) {  // Read name<TAB>median lines
+    char *tab = strrchr(line, '\t');
+    if (line[0] == '#' || tab == NULL || tab - line >= BENCH_NAME) {
+      continue;
+    }
+    memcpy(names[num_base], line, (size_t) (tab - line));
+    names[num_base][tab - line] = '\0';
+    medians[num_base++] = atof(tab + 1);
+  }
+  fclose(in);
+
+  unsigned regressions = 0;
+  printf("\ncompared with %s (threshold %.1f%%)\n", path, threshold);
+  for (unsigned i = 0; i < num_results; i++) {
+    unsigned b = 0;
+    while (b < num_base && strcmp(names[b], results[i].name) != 0) {
+      b++;
+    }
+    if (b == num_base || medians[b] <= 0.0) {
+      printf("%-34s %10s\n", results[i].name, "new");
+      continue;
+    }
+
+    double change = (results[i].median / medians[b] - 1.0) * 100.0;
+    const char *flag = "";
+    if (change > threshold) {
+      flag = "  REGRESSION";
+      regressions++;
+    }
+    else if (change < -threshold) {
+      flag = "  faster";
+    }
+    printf("%-34s %+9.1f%%%s\n", results[i].name, change, flag);
+  }
+  printf("%u regression%s\n", regressions, regressions == 1 ? "" : "s");
+  return regressions;
+}
+
+/*
+ * This function writes buf[] of size n one sample at a time
+ * through write_s16, the way write_s16_buf used to.
+ */
+static void write_s16_each(FILE *out, const int16_t buf[], unsigned n) {
+  for (unsigned i = 0; i < n; i++) {
+    write_s16(out, buf[i]);
+  }
+}
+
+/*
+ * This function reads n samples into buf[] one sample at a time
+ * through read_s16, the way read_s16_buf used to.
+ */
+static unsigned read_s16_each(FILE *in, int16_t buf[], unsigned n) {
+  for (unsigned i = 0; i < n; i++) {
+    read_s16(in, &buf[i]);
+  }
+  return n;
+}
+
+/* raw sample I/O through a temporary file */
+typedef struct {
+  void (*writer)(FILE *, const int16_t[], unsigned);
+  unsigned (*reader)(FILE *, int16_t[], unsigned);
+  FILE *file;
+  int16_t *buf;
+  unsigned n;         /* samples per run */
+} IoCase;
+
+/*
+ * This function writes the samples of an I/O case over the start of
+ * its file.
+ */
+static void run_write(void *arg) {
+  IoCase *io = arg;
+  rewind(io->file);
+  io->writer(io->file, io->buf, io->n);
+  fflush(io->file);
+}
+
+/*
+ * This function reads the samples of an I/O case back from the start
+ * of its file.
+ */
+static void run_read(void *arg) {
+  IoCase *io = arg;
+  rewind(io->file);
+  if (io->reader(io->file, io->buf, io->n) != io->n) {
+    fatal_error("Benchmark input was truncated");
+  }
+}
+
+/*
+ * This function renders a sine wave into channel 0 by calling
+ * sin() on the absolute time of every sample, the way
+ * render_sine_wave used to.
+ */
+static void legacy_sine(int16_t buf[], unsigned num_samples, float freq_hz,
+                        float amplitude) {
+  double time_per_sample = 1.0 / (double) SAMPLES_PER_SECOND;
+  for (unsigned i = 0; i < num_samples * 2; i += 2) {
+    int amp = (int16_t) (amplitude * 32768 *
+                         sin(2 * PI * freq_hz * (i / 2) * time_per_sample));
+    int sum = amp + buf[i];
+    buf[i] = (int16_t) (sum > 32767 ? 32767 : (sum < -32768 ? -32768 : sum));
+  }
+}
+
+/* tones of one voice */
+typedef struct {
+  int16_t *buf;       /* BENCH_FRAMES stereo samples */
+  unsigned voice;
+  unsigned length;    /* (stereo) samples per tone */
+  unsigned notes;     /* tones rendered on top of each other, for chords */
+} ToneCase;
+
+/*
+ * This function fills the buffer of a tone case with back to back
+ * tones of the case's length, so short tones measure the cost per
+ * call and long ones the cost per sample.
+ */
+static void run_tone(void *arg) {
+  ToneCase *tone = arg;
+  for (unsigned done = 0; done < BENCH_FRAMES; done += tone->length) {
+    unsigned count = BENCH_FRAMES - done < tone->length ? BENCH_FRAMES - done : tone->length;
+    for (unsigned note = 0; note < tone->notes; note++) {
+      float freq = (float) (440 * pow(2, (note - 9.0) / 12.0));
+      render_voice_stereo(&tone->buf[2 * done], count, freq, 0.05f, tone->voice);
+    }
+  }
+}
+
+/*
+ * This function renders the buffer of a tone case with sin() per
+ * sample, the reference the oscillators replaced.
+ */
+static void run_legacy_sine(void *arg) {
+  ToneCase *tone = arg;
+  legacy_sine(tone->buf, BENCH_FRAMES, 440.0f, 0.05f);
+}
+
+/*
+ * This function fills song with a dense test song: eight note
+ * chords, each note lasting two beats, starting every beat for
+ * the given number of seconds.
+ */
+static void make_chord_song(Song *song, unsigned seconds) {
+  unsigned beat = SAMPLES_PER_SECOND / 4;
+  song->num_samples = seconds * SAMPLES_PER_SECOND;
+  song->beat = beat;
+  song->sample_rate = SAMPLES_PER_SECOND;
+  song->num_events = 0;
+  song->polyphony = SONG_POLYPHONY;
+  song->map = NULL;
+  song->map_size = 0u;
+  song->max_events = (song->num_samples / beat) * 8;
+  song->events = malloc(song->max_events * sizeof(SongEvent));
+  if (song->events == NULL) {
+    fatal_error("Cannot allocate benchmark song");
+  }
+
+  for (unsigned start = 0; start + beat <= song->num_samples; start += beat) {
+    for (int i = 0; i < 8; i++) {
+      SongEvent *event = &song->events[song->num_events++];
+      event->start = start;
+      event->length = 2 * beat;
+      event->note = 48 + (int) ((start / beat * 5 + i * 7) % 36);
+      event->voice = (start / beat + i) % NUM_VOICES;
+      event->amplitude = 0.05f;
+      event->pan = (i - 3.5f) / 4.0f;
+      event->attack = 0u;
+      event->decay = 0u;
+      event->sustain = 1.0f;
+      event->release = 0u;
+    }
+  }
+}
+
+/* a song render into a temporary file */
+typedef struct {
+  Song song;
+  WaveFormat format;
+  unsigned threads;
+  FILE *out;
+} SongCase;
+
+/*
+ * This function renders the song of a song case over the start of
+ * its file.
+ */
+static void run_song(void *arg) {
+  SongCase *sc = arg;
+  rewind(sc->out);
+  song_render(&sc->song, sc->out, &sc->format, sc->threads, 0, NULL);
+  fflush(sc->out);
+}
+
+/*
+ * This function checks that rendering a dense song with 1, 2, 4, ...
+ * threads up to the number of online CPUs (at least 4) produces the
+ * same bytes every time. Calls fatal_error if not.
+ */
+static void check_song_threads(void) {
+  Song song;
+  make_chord_song(&song, 3);
+  WaveFormat format;
+  wave_format_init(&format, SAMPLES_PER_SECOND, NUM_CHANNELS, BITS_PER_SAMPLE, WAVE_FORMAT_PCM);
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned max_threads = cpus > 4 ? (unsigned) cpus : 4u;
+  FILE *reference = NULL;
+
+  for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+    FILE *out = tmpfile();
+    if (out == NULL) {
+      fatal_error("Cannot open temporary file");
+    }
+    song_render(&song, out, &format, threads, 0, NULL);
+    fflush(out);
+    if (threads == 1) {
+      reference = out;
+      continue;
+    }
+
+    rewind(out);
+    rewind(reference);
+    int a, b;
+    do {
+      a = fgetc(out);
+      b = fgetc(reference);
+    } while (a == b && a != EOF);
+    if (a != b) {
+      fatal_error("Threaded song render differs from the serial render");
+    }
+    fclose(out);
+  }
+
+  fclose(reference);
+  song_free(&song);
+  printf("threaded song renders match the serial render\n");
+}
+
+/* the mixing and conversion kernels */
+typedef struct {
+  void (*mix)(int16_t[], const int16_t[], unsigned);
+  int16_t *dst;
+  const int16_t *src;
+  const float *bus;
+  unsigned n;         /* samples per run */
+} MixCase;
+
+/*
+ * This function mixes the source of a mix case into its destination.
+ */
+static void run_mix(void *arg) {
+  MixCase *mc = arg;
+  mc->mix(mc->dst, mc->src, mc->n);
+}
+
+/*
+ * This function converts the float bus of a mix case to int16_t.
+ */
+static void run_convert(void *arg) {
+  MixCase *mc = arg;
+  mix_f32_to_s16(mc->dst, mc->bus, mc->n);
+}
+
+/*
+ * This function checks that mix_s16 matches mix_s16_scalar bit for
+ * bit on random samples, values at both ends of the int16_t range
+ * and every length up to a few vector widths, so the vector tails
+ * are covered too. Calls fatal_error on the first mismatch.
+ */
+static void check_mix(void) {
+  enum { CHECK_LEN = 4099 };
+  static const int16_t edges[] = { INT16_MIN, INT16_MIN + 1, -1, 0, 1,
+                                   INT16_MAX - 1, INT16_MAX };
+  int16_t src[CHECK_LEN], expected[CHECK_LEN], actual[CHECK_LEN];
+  unsigned num_edges = sizeof(edges) / sizeof(edges[0]);
+
+  srand(1u);
+  for (unsigned i = 0; i < CHECK_LEN; i++) {
+    if (i < num_edges * num_edges) {  // Every pair of edge values first
+      expected[i] = edges[i / num_edges];
+      src[i] = edges[i % num_edges];
+    }
+    else {
+      expected[i] = (int16_t) (rand() % 65536 - 32768);
+      src[i] = (int16_t) (rand() % 65536 - 32768);
+    }
+  }
+
+  for (unsigned n = 0; n <= CHECK_LEN; n += (n < 64u ? 1u : 1009u)) {
+    memcpy(actual, expected, sizeof(expected));
+    int16_t reference[CHECK_LEN];
+    memcpy(reference, expected, sizeof(expected));
+    mix_s16_scalar(reference, src, n);
+    mix_s16(actual, src, n);
+    if (memcmp(reference, actual, sizeof(actual)) != 0) {
+      fatal_error("mix_s16 does not match the scalar reference");
+    }
+  }
+  printf("mix_s16 (%s) matches the scalar reference\n", mix_s16_path());
+}
+
+/* the echo effects over a long input */
+typedef struct {
+  DelayLine line;
+  Convolver conv;
+  const float *in;    /* BENCH_FRAMES stereo samples */
+  float *out;
+} EchoCase;
+
+/*
+ * This function runs the input of an echo case through its delay
+ * line one block at a time.
+ */
+static void run_delay(void *arg) {
+  EchoCase *ec = arg;
+  for (unsigned done = 0; done < BENCH_FRAMES; done += MIX_BLOCK) {
+    unsigned count = BENCH_FRAMES - done < MIX_BLOCK ? BENCH_FRAMES - done : MIX_BLOCK;
+    delay_process(&ec->line, &ec->in[2 * done], &ec->out[2 * done], count);
+  }
+}
+
+/*
+ * This function runs the input of an echo case through its
+ * convolution reverb one partition at a time.
+ */
+static void run_reverb(void *arg) {
+  EchoCase *ec = arg;
+  unsigned block = ec->conv.block;
+  for (unsigned done = 0; done + block <= BENCH_FRAMES; done += block) {
+    conv_process(&ec->conv, &ec->in[2 * done], &ec->out[2 * done]);
+  }
+}
+
+/* resampling 48 kHz input to 44.1 kHz */
+typedef struct {
+  unsigned quality;
+  const int16_t *in;
+  unsigned in_frames;
+  int16_t *out;
+  unsigned out_frames;  /* frames produced by the last run */
+} ResampleCase;
+
+/*
+ * This function resamples the whole input of a resample case, feeding
+ * and draining the resampler a chunk at a time.
+ */
+static void run_resample(void *arg) {
+  ResampleCase *rc = arg;
+  Resampler rs;
+  rs_init(&rs, 48000u, 44100u, rc->quality);
+  unsigned out_frames = rs_output_frames(&rs, rc->in_frames), done = 0, fed = 0;
+
+  while (done < out_frames) {
+    done += rs_pull(&rs, &rc->out[2 * done], out_frames - done);
+    if (fed == rc->in_frames) {
+      break;
+    }
+    unsigned count = rs_space(&rs);  // Fed a chunk at a time, as render_echo does
+    count = count < RS_CHUNK ? count : RS_CHUNK;
+    count = count < rc->in_frames - fed ? count : rc->in_frames - fed;
+    rs_push(&rs, &rc->in[2 * fed], count);
+    fed += count;
+    if (fed == rc->in_frames) {
+      rs_finish(&rs);
+    }
+  }
+  rc->out_frames = done;
+  rs_free(&rs);
+}
+
+/*
+ * This function checks each resampler preset on a 1 kHz sine and
+ * calls fatal_error if the medium or best preset is more than a few
+ * steps off the ideal 44.1 kHz sine. Inputs that are an exact number of
+ * chunks are checked too, since they end with a full buffer.
+ */
+static void check_resample(ResampleCase *rc) {
+  unsigned lengths[] = { rc->in_frames, RS_CHUNK, 2u * RS_CHUNK };
+  for (unsigned l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+    rc->in_frames = lengths[l];
+    for (unsigned q = 0; q < RS_NUM_QUALITIES; q++) {
+      rc->quality = q;
+      run_resample(rc);
+
+      double error = 0.0;
+      for (unsigned k = 100; k + 100 < rc->out_frames; k++) {  // Skip the edges, where the filter sees silence
+        double ideal = 16384.0 * sin(2.0 * PI * 1000.0 * k / 44100.0);
+        error = fabs(rc->out[2 * k] - ideal) > error ? fabs(rc->out[2 * k] - ideal) : error;
+      }
+      if (rc->out_frames != (unsigned) ceil(rc->in_frames * 44100.0 / 48000.0) ||
+          (q != RS_FAST && error > 4.0)) {
+        fatal_error("Resampled sine is wrong");
+      }
+      if (l == 0) {
+        printf("resampler preset %u (%s) max error %.1f steps\n", q, rs_dot_path(), error);
+      }
+    }
+  }
+  rc->in_frames = lengths[0];
+}
+
+/*
+ * This function prints the usage message and exits.
+ */
+static void usage(void) {
+  fprintf(stderr, "Usage: bench [-n runs] [-t threshold%%] [-o baseline] [-c baseline]\n");
+  exit(-1);
+}
+
+/*
+ * This program checks the mixing kernel, threaded song rendering and
+ * the resampler, then times a suite of synthetic workloads: tones of
+ * each voice at several lengths, dense chords and songs, the echo
+ * effects and the resampler over long inputs, the mixing kernels and
+ * raw sample I/O. Every case is warmed up and then timed several
+ * times, and the median and the 10th and 90th percentile are printed.
+ * Usage: bench [-n runs] [-t threshold] [-o baseline] [-c baseline]
+ * With -o the medians are written to a baseline file. With -c they
+ * are compared with one, and every case more than threshold percent
+ * (default 10) slower is flagged; the exit status is then 1 if any
+ * case regressed.
+ */
+int main(int argc, char *argv[]) {
+  const char *save = NULL;  // Baseline file to write
+  const char *compare = NULL;  // Baseline file to compare with
+  double threshold = BENCH_THRESHOLD;
+  for (int arg = 1; arg < argc; arg += 2) {  // Read the options
+    if (arg + 1 >= argc) {
+      usage();
+    }
+    if (strcmp(argv[arg], "-n") == 0) {
+      if (sscanf(argv[arg + 1], "%u", &bench_runs) != 1 || bench_runs < 1 || bench_runs > BENCH_MAX_RUNS) {
+        usage();
+      }
+    }
+    else if (strcmp(argv[arg], "-t") == 0) {
+      if (sscanf(argv[arg + 1], "%lf", &threshold) != 1 || threshold < 0.0) {
+        usage();
+      }
+    }
+    else if (strcmp(argv[arg], "-o") == 0) {
+      save = argv[arg + 1];
+    }
+    else if (strcmp(argv[arg], "-c") == 0) {
+      compare = argv[arg + 1];
+    }
+    else {
+      usage();
+    }
+  }
+
+  int16_t *buf = calloc((size_t) BENCH_FRAMES * 2, sizeof(int16_t));
+  int16_t *other = calloc((size_t) BENCH_FRAMES * 2, sizeof(int16_t));
+  float *bus = calloc((size_t) BENCH_FRAMES * 2, sizeof(float));
+  float *wet = calloc((size_t) BENCH_FRAMES * 2, sizeof(float));
+  if (buf == NULL || other == NULL || bus == NULL || wet == NULL) {
+    fatal_error("Cannot allocate benchmark buffers");
+  }
+  memset(buf, 0, (size_t) BENCH_FRAMES * 2 * sizeof(int16_t));  // Fault in every page before timing
+  memset(wet, 0, (size_t) BENCH_FRAMES * 2 * sizeof(float));
+
+  // Fixed inputs, so every run of the suite does the same work
+  srand(1u);
+  for (unsigned i = 0; i < 2 * BENCH_FRAMES; i++) {
+    bus[i] = (float) (rand() % 20001 - 10000);
+    other[i] = (int16_t) bus[i];
+  }
+
+  check_mix();
+  check_song_threads();
+  ResampleCase rc;
+  rc.in_frames = BENCH_SECONDS * 48000u;
+  int16_t *rs_in = malloc((size_t) rc.in_frames * 2 * sizeof(int16_t));
+  int16_t *rs_out = malloc((size_t) rc.in_frames * 2 * sizeof(int16_t));
+  if (rs_in == NULL || rs_out == NULL) {
+    fatal_error("Cannot allocate benchmark buffers");
+  }
+  for (unsigned i = 0; i < rc.in_frames; i++) {
+    rs_in[2 * i] = rs_in[2 * i + 1] = (int16_t) lrint(16384.0 * sin(2.0 * PI * 1000.0 * i / 48000.0));
+  }
+  rc.in = rs_in;
+  rc.out = rs_out;
+  check_resample(&rc);
+
+  printf("\n%-34s %10s %10s %10s %10s\n", "case", "median s", "p10 s", "p90 s", "rate");
+  char name[BENCH_NAME];
+
+  ToneCase tone = { buf, SINE, BENCH_FRAMES, 1 };
+  bench_case("tone sin() per sample", run_legacy_sine, &tone, BENCH_FRAMES, "Mframes/s");
+  static const unsigned lengths[] = { 256u, 4096u, BENCH_FRAMES };
+  for (unsigned voice = 0; voice < NUM_VOICES; voice++) {  // Each voice at several tone lengths
+    for (unsigned l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+      tone.voice = voice;
+      tone.length = lengths[l];
+      snprintf(name, sizeof(name), "tone voice %u len %u", voice, lengths[l]);
+      bench_case(name, run_tone, &tone, BENCH_FRAMES, "Mframes/s");
+    }
+  }
+  tone.length = BENCH_FRAMES;
+  tone.notes = 10;
+  for (unsigned voice = 0; voice < NUM_VOICES; voice++) {  // Ten note chords
+    tone.voice = voice;
+    snprintf(name, sizeof(name), "chord voice %u", voice);
+    bench_case(name, run_tone, &tone, 10.0 * BENCH_FRAMES, "Mframes/s");
+  }
+
+  SongCase sc;
+  make_chord_song(&sc.song, BENCH_SECONDS);
+  sc.out = tmpfile();
+  if (sc.out == NULL) {
+    fatal_error("Cannot open temporary file");
+  }
+  static const char *const specs[] = { "44100:2:16", "22050:1:16", "48000:2:f32", "96000:2:24" };
+  sc.threads = 1;
+  for (unsigned i = 0; i < sizeof(specs) / sizeof(specs[0]); i++) {  // Dense song in several formats
+    wave_format_parse(specs[i], &sc.format);
+    song_set_rate(&sc.song, sc.format.sample_rate);
+    snprintf(name, sizeof(name), "song %s", specs[i]);
+    bench_case(name, run_song, &sc, sc.song.num_samples, "Mframes/s");
+  }
+  wave_format_parse(specs[0], &sc.format);
+  song_set_rate(&sc.song, sc.format.sample_rate);
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  sc.threads = cpus > 1 ? (unsigned) cpus : 2u;
+  snprintf(name, sizeof(name), "song 44100:2:16 -j %u", sc.threads);
+  bench_case(name, run_song, &sc, sc.song.num_samples, "Mframes/s");
+  fclose(sc.out);
+  song_free(&sc.song);
+
+  EchoCase ec;
+  DelayTap taps[4] = { { 4410u, 0.5f }, { 11025u, 0.3f }, { 22050u, 0.2f }, { 44100u, 0.1f } };
+  delay_init(&ec.line, taps, 4, 0.3f);
+  for (unsigned i = 0; i < BENCH_FRAMES; i++) {  // One second impulse response: decaying noise
+    buf[2 * i] = buf[2 * i + 1] = 0;
+  }
+  for (unsigned i = 0; i < SAMPLES_PER_SECOND; i++) {
+    int16_t value = (int16_t) ((rand() % 20001 - 10000) * exp(-5.0 * i / SAMPLES_PER_SECOND));
+    buf[2 * i] = value;
+    buf[2 * i + 1] = (int16_t) -value;
+  }
+  conv_init(&ec.conv, buf, SAMPLES_PER_SECOND);
+  ec.in = bus;
+  ec.out = wet;
+  bench_case("echo delay 4 taps feedback", run_delay, &ec, BENCH_FRAMES, "Mframes/s");
+  bench_case("echo reverb 1 s impulse", run_reverb, &ec, BENCH_FRAMES / ec.conv.block * ec.conv.block,
+             "Mframes/s");
+  delay_free(&ec.line);
+  conv_free(&ec.conv);
+
+  static const char *const presets[RS_NUM_QUALITIES] = { "fast", "medium", "best" };
+  for (unsigned q = 0; q < RS_NUM_QUALITIES; q++) {
+    rc.quality = q;
+    snprintf(name, sizeof(name), "resample 48k->44.1k %s", presets[q]);
+    bench_case(name, run_resample, &rc, rc.in_frames, "Mframes/s");
+  }
+  free(rs_in);
+  free(rs_out);
+
+  MixCase mc = { mix_s16_scalar, buf, other, bus, 2 * BENCH_FRAMES };
+  bench_case("mix_s16_scalar", run_mix, &mc, 2.0 * BENCH_FRAMES, "Msamples/s");
+  mc.mix = mix_s16;
+  snprintf(name, sizeof(name), "mix_s16 %s", mix_s16_path());
+  bench_case(name, run_mix, &mc, 2.0 * BENCH_FRAMES, "Msamples/s");
+  bench_case("mix_f32_to_s16", run_convert, &mc, 2.0 * BENCH_FRAMES, "Msamples/s");
+
+  IoCase io = { write_s16_each, read_s16_each, tmpfile(), buf, 2 * BENCH_FRAMES };
+  if (io.file == NULL) {
+    fatal_error("Cannot open temporary file");
+  }
+  double bytes = 2.0 * 2.0 * BENCH_FRAMES;
+  bench_case("io write_s16 per sample", run_write, &io, bytes, "MB/s");
+  io.writer = write_s16_buf;
+  bench_case("io write_s16_buf", run_write, &io, bytes, "MB/s");
+  bench_case("io read_s16 per sample", run_read, &io, bytes, "MB/s");
+  io.reader = read_s16_buf;
+  bench_case("io read_s16_buf", run_read, &io, bytes, "MB/s");
+  fclose(io.file);
+
+  free(buf);
+  free(other);
+  free(bus);
+  free(wet);
+
+  unsigned regressions = compare ? compare_baseline(compare, threshold) : 0;
+  if (save) {
+    write_baseline(save);
+  }
+  return regressions > 0;
+}
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "io.h"
+#include "wave.h"
+#include "convolve.h"
+
+/*
+ * Transform re[]/im[] in place with an iterative radix-2 FFT of
+ * length conv->size. The inverse transform is not scaled.
+ * Parameters:
+ *  conv: the convolver holding the twiddle and bit reversal tables
+ *  inverse: nonzero for the inverse transform
+ */
+static void fft(const Convolver *conv, int inverse) {
+  unsigned n = conv->size;
+  float *re = conv->re, *im = conv->im;
+
+  for (unsigned i = 0; i < n; i++) {  // Put the input in bit reversed order
+    unsigned j = conv->reverse[i];
+    if (j > i) {
+      float t = re[i];
+      re[i] = re[j];
+      re[j] = t;
+      t = im[i];
+      im[i] = im[j];
+      im[j] = t;
+    }
+  }
+
+  for (unsigned half = 1; half < n; half *= 2) {  // Combine pairs of transforms of length half
+    unsigned step = n / (2 * half);
+    for (unsigned start = 0; start < n; start += 2 * half) {
+      for (unsigned k = 0; k < half; k++) {
+        float wr = conv->cos_table[k * step];
+        float wi = inverse ? conv->sin_table[k * step] : -conv->sin_table[k * step];
+        unsigned a = start + k, b = a + half;
+        float tr = re[b] * wr - im[b] * wi;
+        float ti = re[b] * wi + im[b] * wr;
+        re[b] = re[a] - tr;
+        im[b] = im[a] - ti;
+        re[a] += tr;
+        im[a] += ti;
+      }
+    }
+  }
+}
+
+/*
+ * Transform one block of stereo input, zero padded to the FFT length,
+ * and store the spectrum of each channel at spectra. Both channels
+ * go through a single complex FFT as its real and imaginary parts and
+ * are separated afterwards using the symmetry of real spectra.
+ * Parameters:
+ *  conv: the convolver
+ *  left, right: the samples of each channel
+ *  stride: distance between consecutive samples in left and right
+ *  count: the number of samples, at most one block
+ *  spectra: where the bins of both channels are stored
+ */
+static void forward_stereo(Convolver *conv, const float *left,
+                           const float *right, unsigned stride,
+                           unsigned count, float spectra[]) {
+  unsigned n = conv->size;
+  float *re = conv->re, *im = conv->im;
+  float *spec_l = spectra, *spec_r = spectra + 2 * conv->bins;
+
+  for (unsigned i = 0; i < n; i++) {
+    re[i] = i < count ? left[i * stride] : 0.0f;
+    im[i] = i < count ? right[i * stride] : 0.0f;
+  }
+  fft(conv, 0);
+
+  for (unsigned k = 0; k < conv->bins; k++) {
+    unsigned nk = (n - k) & (n - 1);
+    spec_l[2 * k] = 0.5f * (re[k] + re[nk]);
+    spec_l[2 * k + 1] = 0.5f * (im[k] - im[nk]);
+    spec_r[2 * k] = 0.5f * (im[k] + im[nk]);
+    spec_r[2 * k + 1] = 0.5f * (re[nk] - re[k]);
+  }
+}
+
+/*
+ * Set up a convolver for a stereo impulse response. The partition
+ * length is the impulse response length rounded up to a power of two,
+ * kept between CONV_MIN_BLOCK and CONV_MAX_BLOCK, so the work per
+ * sample grows with the log of the impulse response length for
+ * responses up to CONV_MAX_BLOCK samples.
+ * Calls fatal_error if memory can't be allocated.
+ * Parameters:
+ *  conv: the convolver to initialize
+ *  ir: the interleaved stereo impulse response
+ *  ir_samples: the number of (stereo) samples in the impulse response
+ */
+void conv_init(Convolver *conv, const int16_t ir[], unsigned ir_samples) {
+  unsigned block = CONV_MIN_BLOCK;
+  while (block < ir_samples && block < CONV_MAX_BLOCK) {
+    block *= 2;
+  }
+
+  conv->block = block;
+  conv->size = 2 * block;
+  conv->bins = block + 1;
+  conv->num_parts = ir_samples ? (ir_samples + block - 1) / block : 1u;
+  conv->head = 0;
+
+  size_t spectra = (size_t) conv->num_parts * 2 * conv->bins * 2;
+  conv->ir = calloc(spectra, sizeof(float));
+  conv->fdl = calloc(spectra, sizeof(float));
+  conv->acc = malloc(4 * conv->bins * sizeof(float));
+  conv->tail = calloc(2 * block, sizeof(float));
+  conv->re = malloc(conv->size * sizeof(float));
+  conv->im = malloc(conv->size * sizeof(float));
+  conv->cos_table = malloc(block * sizeof(float));
+  conv->sin_table = malloc(block * sizeof(float));
+  conv->reverse = malloc(conv->size * sizeof(unsigned));
+  if (conv->ir == NULL || conv->fdl == NULL || conv->acc == NULL || conv->tail == NULL ||
+      conv->re == NULL || conv->im == NULL || conv->cos_table == NULL ||
+      conv->sin_table == NULL || conv->reverse == NULL) {
+    conv_free(conv);
+    fatal_error("Cannot allocate convolution buffers");
+  }
+
+  for (unsigned k = 0; k < block; k++) {
+    conv->cos_table[k] = (float) cos(2.0 * PI * k / conv->size);
+    conv->sin_table[k] = (float) sin(2.0 * PI * k / conv->size);
+  }
+  for (unsigned i = 0; i < conv->size; i++) {
+    unsigned r = 0;
+    for (unsigned bit = 1; bit < conv->size; bit *= 2) {
+      r = (r << 1) | ((i & bit) ? 1u : 0u);
+    }
+    conv->reverse[i] = r;
+  }
+
+  float *samples = malloc(2 * block * sizeof(float));
+  if (samples == NULL) {
+    conv_free(conv);
+    fatal_error("Cannot allocate convolution buffers");
+  }
+  for (unsigned p = 0; p < conv->num_parts; p++) {  // Transform each partition of the response
+    unsigned first = p * block;
+    unsigned count = ir_samples - first < block ? ir_samples - first : block;
+    for (unsigned i = 0; i < 2 * count; i++) {
+      samples[i] = ir[2 * first + i] / 32768.0f;
+    }
+    forward_stereo(conv, &samples[0], &samples[1], 2, count,
+                   &conv->ir[(size_t) p * 4 * conv->bins]);
+  }
+  free(samples);
+}
+
+/*
+ * Convolve the next block of stereo input with the impulse response.
+ * Parameters:
+ *  conv: the convolver
+ *  in: conv->block interleaved stereo input samples
+ *  out: where conv->block interleaved stereo output samples are stored
+ */
+void conv_process(Convolver *conv, const float in[], float out[]) {
+  unsigned n = conv->size, bins = conv->bins, block = conv->block;
+  float *re = conv->re, *im = conv->im;
+
+  forward_stereo(conv, &in[0], &in[1], 2, block,
+                 &conv->fdl[(size_t) conv->head * 4 * bins]);
+
+  /* sum each input spectrum times the partition it has reached */
+  float *acc = conv->acc;
+  memset(acc, 0, 4 * bins * sizeof(float));
+  for (unsigned p = 0; p < conv->num_parts; p++) {
+    unsigned slot = (conv->head + conv->num_parts - p) % conv->num_parts;
+    const float *x = &conv->fdl[(size_t) slot * 4 * bins];
+    const float *h = &conv->ir[(size_t) p * 4 * bins];
+    for (unsigned k = 0; k < 2 * bins; k++) {  // Both channels, one complex bin at a time
+      acc[2 * k] += x[2 * k] * h[2 * k] - x[2 * k + 1] * h[2 * k + 1];
+      acc[2 * k + 1] += x[2 * k] * h[2 * k + 1] + x[2 * k + 1] * h[2 * k];
+    }
+  }
+  conv->head = (conv->head + 1) % conv->num_parts;
+
+  /* pack left + i * right back into one full spectrum */
+  const float *acc_l = acc, *acc_r = acc + 2 * bins;
+  for (unsigned k = 0; k < bins; k++) {
+    re[k] = acc_l[2 * k] - acc_r[2 * k + 1];
+    im[k] = acc_l[2 * k + 1] + acc_r[2 * k];
+    if (k > 0 && k < block) {
+      re[n - k] = acc_l[2 * k] + acc_r[2 * k + 1];
+      im[n - k] = acc_r[2 * k] - acc_l[2 * k + 1];
+    }
+  }
+  fft(conv, 1);
+
+  float scale = 1.0f / n;
+  for (unsigned i = 0; i < block; i++) {  // Overlap-add with the previous block's tail
+    out[2 * i] = re[i] * scale + conv->tail[i];
+    out[2 * i + 1] = im[i] * scale + conv->tail[block + i];
+    conv->tail[i] = re[block + i] * scale;
+    conv->tail[block + i] = im[block + i] * scale;
+  }
+}
+
+/*
+ * Free the memory held by a convolver.
+ */
+void conv_free(Convolver *conv) {
+  free(conv->ir);
+  free(conv->fdl);
+  free(conv->acc);
+  free(conv->tail);
+  free(conv->re);
+  free(conv->im);
+  free(conv->cos_table);
+  free(conv->sin_table);
+  free(conv->reverse);
+  memset(conv, 0, sizeof(*conv));
+}
@@ -0,0 +1,31 @@
+#ifndef CONVOLVE_H
+#define CONVOLVE_H
+
+#include <stdint.h>
+
+#define CONV_MIN_BLOCK 64u    /* shortest partition, in (stereo) samples */
+#define CONV_MAX_BLOCK 16384u /* longest partition, in (stereo) samples */
+
+/* stereo partitioned overlap-add FFT convolver */
+typedef struct {
+  unsigned block;      /* partition length and samples per call */
+  unsigned size;       /* FFT length, twice the partition length */
+  unsigned bins;       /* spectrum bins kept per channel, block + 1 */
+  unsigned num_parts;  /* partitions the impulse response is split into */
+  unsigned head;       /* slot of the newest input spectrum */
+  float *ir;           /* impulse response spectra, num_parts * 2 channels * bins complex */
+  float *fdl;          /* input spectra of the last num_parts blocks, same layout */
+  float *acc;          /* output spectra being summed, 2 channels * bins complex */
+  float *tail;         /* overlap carried into the next block, 2 channels * block */
+  float *re;           /* FFT work buffers */
+  float *im;
+  float *cos_table;    /* FFT twiddle factors */
+  float *sin_table;
+  unsigned *reverse;   /* bit reversed index of each FFT position */
+} Convolver;
+
+void conv_init(Convolver *conv, const int16_t ir[], unsigned ir_samples);
+void conv_process(Convolver *conv, const float in[], float out[]);
+void conv_free(Convolver *conv);
+
+#endif /* CONVOLVE_H */
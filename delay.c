@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "io.h"
+#include "delay.h"
+
+/*
+ * Set up a delay line. The line holds the input plus the feedback
+ * from its longest tap; each output sample is the input plus every
+ * tap's read of the line times the tap's gain. The ring buffer is
+ * sized to the longest delay, so memory does not depend on the length
+ * of the audio that goes through the line.
+ * Calls fatal_error if the taps are invalid or memory can't be
+ * allocated.
+ * Parameters:
+ *  line: the delay line to initialize
+ *  taps: the output taps
+ *  num_taps: the number of taps, at most DELAY_MAX_TAPS
+ *  feedback: gain of the signal at the longest tap fed back into the line;
+ *            needs a longest delay of at least one sample
+ */
+void delay_init(DelayLine *line, const DelayTap taps[], unsigned num_taps,
+                float feedback) {
+  if (num_taps > DELAY_MAX_TAPS) {
+    fatal_error("Too many delay taps");
+  }
+
+  line->num_taps = num_taps;
+  line->longest = 0u;
+  for (unsigned t = 0; t < num_taps; t++) {
+    line->taps[t] = taps[t];
+    line->longest = taps[t].delay > line->longest ? taps[t].delay : line->longest;
+  }
+  if (feedback != 0.0f && line->longest == 0u) {
+    fatal_error("Feedback needs a delay of at least one sample");
+  }
+  line->feedback = feedback;
+
+  unsigned size = 1u;
+  while (size <= line->longest) {  // Smallest power of two that holds the longest delay
+    if (size > (1u << 30)) {
+      fatal_error("Delay is too long");
+    }
+    size *= 2u;
+  }
+  line->mask = size - 1u;
+  line->pos = 0u;
+  line->ring = calloc((size_t) size * 2, sizeof(float));
+  if (line->ring == NULL) {
+    fatal_error("Cannot allocate delay line");
+  }
+}
+
+/*
+ * Run a block of stereo samples through a delay line.
+ * Parameters:
+ *  line: the delay line
+ *  in: num_samples interleaved stereo input samples
+ *  out: where num_samples interleaved stereo output samples are stored;
+ *       may be the same buffer as in
+ *  num_samples: the number of (stereo) samples in the block
+ */
+void delay_process(DelayLine *line, const float in[], float out[],
+                   unsigned num_samples) {
+  float *ring = line->ring;
+  unsigned mask = line->mask;
+  unsigned pos = line->pos;
+
+  for (unsigned i = 0; i < num_samples; i++, pos = (pos + 1u) & mask) {
+    float left = in[2 * i], right = in[2 * i + 1];
+
+    unsigned back = (pos - line->longest) & mask;  // Store the input plus the feedback
+    ring[2 * pos] = left + line->feedback * ring[2 * back];
+    ring[2 * pos + 1] = right + line->feedback * ring[2 * back + 1];
+
+    for (unsigned t = 0; t < line->num_taps; t++) {  // Add every tap to the input
+      unsigned from = (pos - line->taps[t].delay) & mask;
+      left += line->taps[t].gain * ring[2 * from];
+      right += line->taps[t].gain * ring[2 * from + 1];
+    }
+    out[2 * i] = left;
+    out[2 * i + 1] = right;
+  }
+
+  line->pos = pos;
+}
+
+/*
+ * Free the memory held by a delay line.
+ */
+void delay_free(DelayLine *line) {
+  free(line->ring);
+  line->ring = NULL;
+}
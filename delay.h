@@ -0,0 +1,31 @@
+#ifndef DELAY_H
+#define DELAY_H
+
+#include <stdint.h>
+
+#define DELAY_MAX_TAPS 32u /* most taps a delay line can have */
+
+/* one output tap of a delay line */
+typedef struct {
+  unsigned delay;  /* how far back the tap reads, in (stereo) samples */
+  float gain;      /* gain applied to what the tap reads */
+} DelayTap;
+
+/* stereo multi-tap feedback delay line over a ring buffer */
+typedef struct {
+  float *ring;         /* interleaved stereo history of the line */
+  unsigned mask;       /* ring length in (stereo) samples minus one */
+  unsigned pos;        /* ring position of the next sample */
+  DelayTap taps[DELAY_MAX_TAPS];
+  unsigned num_taps;
+  unsigned longest;    /* longest tap delay, where feedback is taken */
+  float feedback;      /* gain of the longest tap fed back into the line */
+} DelayLine;
+
+void delay_init(DelayLine *line, const DelayTap taps[], unsigned num_taps,
+  float feedback);
+void delay_process(DelayLine *line, const float in[], float out[],
+  unsigned num_samples);
+void delay_free(DelayLine *line);
+
+#endif /* DELAY_H */
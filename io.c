@@ -7,15 +7,58 @@
 #include "io.h"
 #include <math.h>
 
+#define IO_BLOCK_SAMPLES 4096u  // Samples converted per staging block
+
+/*
+ * This function returns 1 if the host stores multi-byte
+ * integers least significant byte first, and 0 otherwise.
+ */
+int host_is_little_endian(void) {
+  const uint16_t probe = 1u;
+  return *(const unsigned char *) &probe == 1u;
+}
+
+static __thread FatalTrap *fatal_trap;  // This thread's innermost trap, if any
+
 /* 
  * This function takes in an error message and prints
  * it to stderr. The function then quits the program.
+ * If the calling thread has set a trap, the message is stored in it
+ * and the thread jumps back to its setjmp instead, with the trap
+ * cleared. Code that calls this releases what it owns first, so the
+ * trap's owner only has to release what it set up itself.
  */
 void fatal_error(const char *message) {
+  FatalTrap *trap = fatal_trap;
+  if (trap) {  // Hand the error back to whoever set the trap
+    fatal_trap = trap->outer;
+    trap->message = message;
+    longjmp(trap->env, 1);
+  }
   fprintf(stderr, "Error: %s\n", message);  // Print the inputed message
   exit(-1);   // Exit the program
 }
 
+/*
+ * This function makes fatal_error on the calling thread jump back to
+ * trap instead of exiting, until fatal_trap_clear. Call setjmp on
+ * trap->env straight after; it returns nonzero when an error arrives.
+ * Traps nest: an error goes to the innermost one.
+ */
+void fatal_trap_set(FatalTrap *trap) {
+  trap->message = NULL;
+  trap->outer = fatal_trap;
+  fatal_trap = trap;
+}
+
+/*
+ * This function removes the innermost trap of the calling thread,
+ * which must be trap, once the code it guards has finished.
+ */
+void fatal_trap_clear(FatalTrap *trap) {
+  fatal_trap = trap->outer;
+}
+
 
 /*
  * This function takes a character and an open FILE
@@ -72,7 +115,7 @@ void write_u32(FILE *out, uint32_t value) {
   }
   else {
     for (int i = 0; i < 4; i++) {  // Loop to calculate the least to most significant byte and write them to file
-      uint32_t var = ((uint32_t) (value / pow(256, (double)i))) % 256;  
+      uint32_t var = (value >> (8 * i)) & 0xFF;
       fputc(var, out);
     }
   }
@@ -94,18 +137,52 @@ void write_s16(FILE *out, int16_t value) {
   }
 }
 
-/* This function makes a series of calls to write_s16
- * to write the arguments of the array buf[] of size n to the 
- * FILE stream.
+/* This function writes the array buf[] of size n to the FILE
+ * stream in little endian format. Samples are converted a block
+ * at a time into a staging buffer and each block is written with
+ * a single fwrite, so the cost per sample is a byte copy instead
+ * of two library calls. On little endian hosts the in-memory
+ * layout already matches the file layout and buf is written as is.
  */
 void write_s16_buf(FILE *out, const int16_t buf[], unsigned n) {
   if (out == NULL) {  // Check if the file was opened properly
     fatal_error("File is NULL");
   }
-  else {
-    for (unsigned i = 0; i < n; i++) {   // Loop to call write_s16 for each array index
-      write_s16(out, buf[i]);
+
+  if (host_is_little_endian()) {  // No conversion needed, write the whole buffer at once
+    if (fwrite(buf, sizeof(int16_t), n, out) != n) {
+      fatal_error("Could not write samples to file");
     }
+    return;
+  }
+
+  unsigned char staging[IO_BLOCK_SAMPLES * 2u];
+  while (n > 0) {  // Convert and write one block at a time
+    unsigned count = n < IO_BLOCK_SAMPLES ? n : IO_BLOCK_SAMPLES;
+    for (unsigned i = 0; i < count; i++) {
+      uint16_t value = (uint16_t) buf[i];
+      staging[2 * i] = value & 0xFF;            // Least significant byte
+      staging[2 * i + 1] = (value >> 8) & 0xFF; // Most significant byte
+    }
+    if (fwrite(staging, 2u, count, out) != count) {
+      fatal_error("Could not write samples to file");
+    }
+    buf += count;
+    n -= count;
+  }
+}
+
+/*
+ * This function writes the n bytes of buf[] to the FILE stream
+ * with a single fwrite. The bytes must already be in file order.
+ */
+void write_u8_buf(FILE *out, const uint8_t buf[], unsigned n) {
+  if (out == NULL) {  // Check if the file was opened properly
+    fatal_error("File is NULL");
+  }
+
+  if (fwrite(buf, 1u, n, out) != n) {
+    fatal_error("Could not write samples to file");
   }
 }
 
@@ -171,7 +248,7 @@ void read_u32(FILE *in, uint32_t *val) {
     fatal_error("Nothing to be read from file");
   }
   else {
-    *val = var1 + (var2 * 256) + (var3 * pow(256, 2)) + (var4 * pow(256, 3));  // Put the bytes together and store into pointer variable
+    *val = (uint32_t) var1 | ((uint32_t) var2 << 8) | ((uint32_t) var3 << 16) | ((uint32_t) var4 << 24);  // Put the bytes together and store into pointer variable
   }
 }
 
@@ -194,12 +271,40 @@ void read_s16(FILE *in, int16_t *val) {
   }
 }
 
-/* 
- * This function makes calls to read_s16 in order to fill the 
- * array buf[] of size n with the read in data values.
+/*
+ * This function fills the array buf[] of size n with int16_t
+ * values read from the FILE stream. The data is read in blocks
+ * with fread and byte swapped only on big endian hosts.
+ * Returns the number of values actually read, which is less than
+ * n only if the stream ended early. A read error is fatal, so a
+ * short count always means the input was truncated.
  */
-void read_s16_buf(FILE *in, int16_t buf[], unsigned n) {
-  for (int i = 0; i < (int)n; i++) {  // Read bytes and input them into each array index
-    read_s16(in, &buf[i]);
+unsigned read_s16_buf(FILE *in, int16_t buf[], unsigned n) {
+  if (in == NULL) {  // Check if the file was opened properly
+    fatal_error("File is NULL");
+  }
+
+  int little = host_is_little_endian();
+  unsigned total = 0;
+  while (total < n) {  // Read one block at a time until n values or end of file
+    unsigned want = n - total < IO_BLOCK_SAMPLES ? n - total : IO_BLOCK_SAMPLES;
+    size_t got = fread(&buf[total], sizeof(int16_t), want, in);
+
+    if (!little) {  // Rebuild each value from its little endian bytes
+      unsigned char *bytes = (unsigned char *) &buf[total];
+      for (size_t i = 0; i < got; i++) {
+        uint16_t value = bytes[2 * i] | (bytes[2 * i + 1] << 8);
+        buf[total + i] = (int16_t) value;
+      }
+    }
+
+    total += (unsigned) got;
+    if (got < want) {
+      if (ferror(in)) {  // Distinguish an I/O failure from a short file
+        fatal_error("Error reading samples from file");
+      }
+      break;
+    }
   }
+  return total;
 }
@@ -2,9 +2,20 @@
 #define IO_H
 
 #include <stdint.h>
+#include <setjmp.h>
 #include <math.h>
 
+/* a point this thread's fatal_error jumps back to instead of exiting */
+typedef struct FatalTrap {
+  jmp_buf env;              /* set with setjmp right after fatal_trap_set */
+  const char *message;      /* the error, once fatal_error has jumped here */
+  struct FatalTrap *outer;  /* the trap that was set before this one, or NULL */
+} FatalTrap;
+
 void fatal_error(const char *message);
+void fatal_trap_set(FatalTrap *trap);
+void fatal_trap_clear(FatalTrap *trap);
+int host_is_little_endian(void);
 
 void write_byte(FILE *out, char val);
 void write_bytes(FILE *out, const char data[], unsigned n);
@@ -12,12 +23,13 @@ void write_u16(FILE *out, uint16_t value);
 void write_u32(FILE *out, uint32_t value);
 void write_s16(FILE *out, int16_t value);
 void write_s16_buf(FILE *out, const int16_t buf[], unsigned n);
+void write_u8_buf(FILE *out, const uint8_t buf[], unsigned n);
 
 void read_byte(FILE *in, char *val);
 void read_bytes(FILE *in, char data[], unsigned n);
 void read_u16(FILE *in, uint16_t *val);
 void read_u32(FILE *in, uint32_t *val);
 void read_s16(FILE *in, int16_t *val);
-void read_s16_buf(FILE *in, int16_t buf[], unsigned n);
+unsigned read_s16_buf(FILE *in, int16_t buf[], unsigned n);
 
 #endif /* IO_H */
@@ -0,0 +1,601 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "io.h"
+#include "wave.h"
+#include "song.h"
+#include "midi.h"
+
+#define MIDI_NO_TICK UINT64_MAX  /* off tick of a note that is still on */
+#define MIDI_NO_NOTE UINT32_MAX  /* end of a list of sounding notes */
+#define MIDI_KEYS    128u
+
+/* cursor over the bytes of a MIDI file */
+typedef struct {
+  const uint8_t *pos;
+  const uint8_t *end;
+  Song *song;        /* released if the file turns out to be bad */
+} MidiReader;
+
+/* a tempo change, from the tick it happens at */
+typedef struct {
+  uint64_t tick;
+  uint32_t tempo;    /* microseconds per quarter note */
+  unsigned order;    /* position in the file, to break ties */
+  double micros;     /* microseconds from the start of the song to tick */
+} MidiTempo;
+
+/* a channel message read from a track, kept until every track is read */
+typedef struct {
+  uint64_t tick;
+  uint8_t status;    /* message type and channel */
+  uint8_t data1;     /* key, controller or program */
+  uint8_t data2;     /* velocity or controller value */
+} MidiEvent;
+
+/* a note of the merged tracks, timed in ticks until every tempo is known */
+typedef struct {
+  uint64_t on;       /* tick of the note on */
+  uint64_t off;      /* tick of the note off, or MIDI_NO_TICK */
+  uint32_t next;     /* next sounding note of the same channel and key, or MIDI_NO_NOTE */
+  uint8_t key;
+  uint32_t voice;
+  float amplitude;
+  float pan;
+} MidiNote;
+
+/* what the file holds once every track has been read */
+typedef struct {
+  MidiTempo *tempos;
+  unsigned num_tempos;
+  unsigned max_tempos;
+  MidiEvent *events;   /* channel messages of every track, in file order */
+  unsigned num_events;
+  unsigned max_events;
+  MidiNote *notes;
+  unsigned num_notes;
+  unsigned max_notes;
+  uint64_t last_tick;  /* latest end of track */
+  double tick_micros;  /* microseconds per tick for SMPTE time, 0 for tempo based time */
+  unsigned division;   /* ticks per quarter note for tempo based time */
+} MidiScore;
+
+/* the controller state of one channel */
+typedef struct {
+  uint8_t program;
+  uint8_t volume;      /* controller 7 */
+  uint8_t expression;  /* controller 11 */
+  uint8_t pan;         /* controller 10, 64 is the center */
+} MidiChannel;
+
+/*
+ * render_voice voice for each General MIDI instrument family of eight
+ * programs: soft and plucked instruments get the sine, organs, reeds
+ * and leads the square, and bowed, blown and synthetic sounds the saw.
+ */
+static const uint32_t family_voice[16] = {
+  WT_SINE,    /* piano */
+  WT_SINE,    /* chromatic percussion */
+  WT_SQUARE,  /* organ */
+  WT_SINE,    /* guitar */
+  WT_SAW,     /* bass */
+  WT_SAW,     /* strings */
+  WT_SAW,     /* ensemble */
+  WT_SAW,     /* brass */
+  WT_SQUARE,  /* reed */
+  WT_SINE,    /* pipe */
+  WT_SQUARE,  /* synth lead */
+  WT_SINE,    /* synth pad */
+  WT_SAW,     /* synth effects */
+  WT_SINE,    /* ethnic */
+  WT_SINE,    /* percussive */
+  WT_SAW      /* sound effects */
+};
+
+/*
+ * Release what has been read and report a bad MIDI file.
+ */
+static void midi_error(MidiScore *score, Song *song, const char *message) {
+  free(score->tempos);
+  free(score->events);
+  free(score->notes);
+  song_free(song);
+  fatal_error(message);
+}
+
+/*
+ * Return the next byte of a reader, which must hold at least one more.
+ */
+static uint8_t midi_byte(MidiReader *reader, MidiScore *score) {
+  if (reader->pos == reader->end) {
+    midi_error(score, reader->song, "Truncated MIDI file");
+  }
+  return *reader->pos++;
+}
+
+/*
+ * Return the next n (at most 4) bytes of a reader as a big endian number.
+ */
+static uint32_t midi_number(MidiReader *reader, MidiScore *score, unsigned n) {
+  uint32_t value = 0u;
+  for (unsigned i = 0; i < n; i++) {
+    value = (value << 8) | midi_byte(reader, score);
+  }
+  return value;
+}
+
+/*
+ * Return the next variable length quantity of a reader: up to four
+ * bytes of seven bits each, most significant first, with the top bit
+ * set on all but the last.
+ */
+static uint32_t midi_varlen(MidiReader *reader, MidiScore *score) {
+  uint32_t value = 0u;
+  for (unsigned i = 0; i < 4u; i++) {
+    uint8_t byte = midi_byte(reader, score);
+    value = (value << 7) | (byte & 0x7Fu);
+    if (!(byte & 0x80u)) {
+      return value;
+    }
+  }
+  midi_error(score, reader->song, "Bad MIDI variable length number");
+  return 0u;
+}
+
+/*
+ * Skip n bytes of a reader.
+ */
+static void midi_skip(MidiReader *reader, MidiScore *score, uint32_t n) {
+  if ((size_t) (reader->end - reader->pos) < n) {
+    midi_error(score, reader->song, "Truncated MIDI file");
+  }
+  reader->pos += n;
+}
+
+/*
+ * Add a tempo change to a score.
+ */
+static void add_tempo(MidiScore *score, Song *song, uint64_t tick, uint32_t tempo) {
+  if (score->num_tempos == score->max_tempos) {  // Grow the tempo map
+    unsigned max_tempos = score->max_tempos ? 2 * score->max_tempos : 16u;
+    MidiTempo *tempos = realloc(score->tempos, max_tempos * sizeof(MidiTempo));
+    if (tempos == NULL) {
+      midi_error(score, song, "Cannot allocate MIDI tempo map");
+    }
+    score->tempos = tempos;
+    score->max_tempos = max_tempos;
+  }
+  MidiTempo *change = &score->tempos[score->num_tempos++];
+  change->tick = tick;
+  change->tempo = tempo;
+  change->order = score->num_tempos;
+}
+
+/*
+ * Add a channel message of a track to a score.
+ */
+static void add_event(MidiScore *score, Song *song, uint64_t tick, uint8_t status,
+                      uint8_t data1, uint8_t data2) {
+  if (score->num_events == score->max_events) {  // Grow the message list
+    unsigned max_events = score->max_events ? 2 * score->max_events : 256u;
+    MidiEvent *events = realloc(score->events, max_events * sizeof(MidiEvent));
+    if (events == NULL) {
+      midi_error(score, song, "Cannot allocate MIDI events");
+    }
+    score->events = events;
+    score->max_events = max_events;
+  }
+  MidiEvent *event = &score->events[score->num_events++];
+  event->tick = tick;
+  event->status = status;
+  event->data1 = data1;
+  event->data2 = data2;
+}
+
+/*
+ * Start a note in a score with the channel's current controllers.
+ * Returns the index of the note.
+ */
+static uint32_t note_on(MidiScore *score, Song *song, uint64_t tick, uint8_t key,
+                        uint8_t velocity, const MidiChannel *state) {
+  if (score->num_notes == score->max_notes) {  // Grow the note list
+    unsigned max_notes = score->max_notes ? 2 * score->max_notes : 256u;
+    MidiNote *notes = realloc(score->notes, max_notes * sizeof(MidiNote));
+    if (notes == NULL) {
+      midi_error(score, song, "Cannot allocate MIDI notes");
+    }
+    score->notes = notes;
+    score->max_notes = max_notes;
+  }
+  MidiNote *note = &score->notes[score->num_notes];
+  note->on = tick;
+  note->off = MIDI_NO_TICK;
+  note->next = MIDI_NO_NOTE;
+  note->key = key;
+  note->voice = family_voice[state->program >> 3];
+  note->amplitude = MIDI_AMPLITUDE * (velocity / 127.0f) * (state->volume / 127.0f) *
+                    (state->expression / 127.0f);
+  float pan = (state->pan - 64) / 63.0f;
+  note->pan = pan < -1.0f ? -1.0f : (pan > 1.0f ? 1.0f : pan);
+  return score->num_notes++;
+}
+
+/*
+ * Read the events of one track chunk, adding its tempo changes to the
+ * score and keeping its note, controller and program messages to be
+ * played once every track is read. Notes of the percussion channel are
+ * dropped here.
+ */
+static void read_track(MidiReader *reader, MidiScore *score) {
+  uint64_t tick = 0u;
+  uint8_t status = 0u;  // Running status
+  while (reader->pos < reader->end) {  // One event at a time
+    tick += midi_varlen(reader, score);
+    uint8_t byte = midi_byte(reader, score);
+
+    if (byte == 0xFFu) {  // Meta event
+      uint8_t type = midi_byte(reader, score);
+      uint32_t length = midi_varlen(reader, score);
+      if (type == 0x51u && length == 3u) {  // Set tempo
+        add_tempo(score, reader->song, tick, midi_number(reader, score, 3u));
+      }
+      else if (type == 0x2Fu) {  // End of track
+        midi_skip(reader, score, length);
+        break;
+      }
+      else {
+        midi_skip(reader, score, length);
+      }
+      status = 0u;
+      continue;
+    }
+    if (byte == 0xF0u || byte == 0xF7u) {  // System exclusive
+      midi_skip(reader, score, midi_varlen(reader, score));
+      status = 0u;
+      continue;
+    }
+
+    if (byte & 0x80u) {
+      status = byte;
+      byte = midi_byte(reader, score);
+    }
+    else if (status == 0u) {
+      midi_error(score, reader->song, "MIDI data byte without a status");
+    }
+
+    uint8_t data = 0u;
+    switch (status & 0xF0u) {
+    case 0x80u:  // Note off
+    case 0x90u:  // Note on; velocity 0 is a note off
+      data = midi_byte(reader, score) & 0x7Fu;
+      if ((status & 0x0Fu) != MIDI_DRUMS) {
+        add_event(score, reader->song, tick, status, byte & 0x7Fu, data);
+      }
+      break;
+    case 0xB0u:  // Controller
+      data = midi_byte(reader, score) & 0x7Fu;
+      if (byte == 7u || byte == 10u || byte == 11u) {
+        add_event(score, reader->song, tick, status, byte, data);
+      }
+      break;
+    case 0xC0u:  // Program change
+      add_event(score, reader->song, tick, status, byte & 0x7Fu, 0u);
+      break;
+    case 0xD0u:  // Channel pressure
+      break;
+    case 0xA0u:  // Key pressure
+    case 0xE0u:  // Pitch bend
+      midi_byte(reader, score);
+      break;
+    default:  // System common messages
+      midi_error(score, reader->song, "Unsupported MIDI event");
+    }
+  }
+  score->last_tick = tick > score->last_tick ? tick : score->last_tick;
+}
+
+/*
+ * Return the end of the run of messages in order of tick that starts
+ * at first.
+ */
+static unsigned run_end(const MidiEvent events[], unsigned first, unsigned n) {
+  unsigned end = first + 1u;
+  while (end < n && events[end - 1].tick <= events[end].tick) {
+    end++;
+  }
+  return end;
+}
+
+/*
+ * Sort the channel messages of every track by tick. Messages at the
+ * same tick keep file order, track by track, so a controller set in
+ * an earlier track applies to notes at the same tick in later ones.
+ * Each track is already in order, so this merges neighbouring runs
+ * (a natural merge sort, stable unlike qsort) and takes one pass per
+ * doubling of the track count; a type 0 file is left alone.
+ */
+static void sort_events(MidiScore *score, Song *song) {
+  unsigned n = score->num_events;
+  if (n == 0u || run_end(score->events, 0u, n) == n) {
+    return;
+  }
+
+  MidiEvent *from = score->events;
+  MidiEvent *to = malloc(n * sizeof(MidiEvent));
+  if (to == NULL) {
+    midi_error(score, song, "Cannot allocate MIDI events");
+  }
+  unsigned runs;
+  do {  // Merge each pair of neighbouring runs into one
+    runs = 0u;
+    for (unsigned lo = 0; lo < n; runs++) {
+      unsigned mid = run_end(from, lo, n);
+      unsigned hi = mid < n ? run_end(from, mid, n) : n;
+      unsigned a = lo, b = mid, k = lo;
+      while (a < mid && b < hi) {
+        to[k++] = from[b].tick < from[a].tick ? from[b++] : from[a++];
+      }
+      while (a < mid) {
+        to[k++] = from[a++];
+      }
+      while (b < hi) {
+        to[k++] = from[b++];
+      }
+      lo = hi;
+    }
+    MidiEvent *swap = from;
+    from = to;
+    to = swap;
+  } while (runs > 1u);
+  free(to);
+  score->events = from;
+  score->max_events = n;
+}
+
+/*
+ * Play the merged channel messages in order of tick, turning them into
+ * notes. Each channel keeps its program and controllers across tracks,
+ * and a note off ends the oldest sounding note of its channel and key
+ * whichever track it is in; notes still on at the end end with the
+ * longest track.
+ */
+static void play_events(MidiScore *score, Song *song) {
+  MidiChannel channels[MIDI_CHANNELS];
+  uint32_t oldest[MIDI_CHANNELS * MIDI_KEYS];  // Sounding notes of each channel and key, oldest first
+  uint32_t newest[MIDI_CHANNELS * MIDI_KEYS];
+  for (unsigned k = 0; k < MIDI_CHANNELS * MIDI_KEYS; k++) {
+    oldest[k] = newest[k] = MIDI_NO_NOTE;
+  }
+  for (unsigned c = 0; c < MIDI_CHANNELS; c++) {
+    channels[c].program = 0u;
+    channels[c].volume = MIDI_VOLUME;
+    channels[c].expression = 127u;
+    channels[c].pan = 64u;
+  }
+
+  for (unsigned e = 0; e < score->num_events; e++) {
+    const MidiEvent *event = &score->events[e];
+    uint8_t channel = event->status & 0x0Fu;
+    MidiChannel *state = &channels[channel];
+    unsigned list = channel * MIDI_KEYS + event->data1;
+    switch (event->status & 0xF0u) {
+    case 0x80u:  // Note off
+    case 0x90u:  // Note on; velocity 0 is a note off
+      if ((event->status & 0xF0u) == 0x90u && event->data2 > 0u) {
+        uint32_t n = note_on(score, song, event->tick, event->data1, event->data2, state);
+        if (newest[list] == MIDI_NO_NOTE) {
+          oldest[list] = n;
+        }
+        else {
+          score->notes[newest[list]].next = n;
+        }
+        newest[list] = n;
+      }
+      else if (oldest[list] != MIDI_NO_NOTE) {
+        MidiNote *note = &score->notes[oldest[list]];
+        note->off = event->tick;
+        oldest[list] = note->next;
+        if (oldest[list] == MIDI_NO_NOTE) {
+          newest[list] = MIDI_NO_NOTE;
+        }
+      }
+      break;
+    case 0xB0u:  // Controller
+      if (event->data1 == 7u) {
+        state->volume = event->data2;
+      }
+      else if (event->data1 == 10u) {
+        state->pan = event->data2;
+      }
+      else {
+        state->expression = event->data2;
+      }
+      break;
+    default:  // Program change
+      state->program = event->data1;
+      break;
+    }
+  }
+
+  for (unsigned k = 0; k < MIDI_CHANNELS * MIDI_KEYS; k++) {  // End notes that are still on
+    for (uint32_t n = oldest[k]; n != MIDI_NO_NOTE; n = score->notes[n].next) {
+      score->notes[n].off = score->last_tick;
+    }
+  }
+}
+
+/*
+ * Order two tempo changes by tick for qsort. Changes at the same tick
+ * keep the order they were read in, so the last one read wins.
+ */
+static int compare_tempos(const void *a, const void *b) {
+  const MidiTempo *x = a, *y = b;
+  if (x->tick != y->tick) {
+    return x->tick < y->tick ? -1 : 1;
+  }
+  return x->order < y->order ? -1 : (x->order > y->order);
+}
+
+/*
+ * Return the sample, at the song's rate, that a tick falls on.
+ */
+static uint32_t tick_to_sample(const MidiScore *score, uint32_t sample_rate, uint64_t tick) {
+  double micros;
+  if (score->tick_micros > 0.0) {  // SMPTE time: a fixed length per tick
+    micros = tick * score->tick_micros;
+  }
+  else {
+    unsigned lo = 0u, hi = score->num_tempos;
+    while (hi - lo > 1u) {  // Find the last tempo change at or before tick
+      unsigned mid = lo + (hi - lo) / 2u;
+      if (score->tempos[mid].tick <= tick) {
+        lo = mid;
+      }
+      else {
+        hi = mid;
+      }
+    }
+    const MidiTempo *change = &score->tempos[lo];
+    micros = change->micros + (double) (tick - change->tick) * change->tempo / score->division;
+  }
+
+  double sample = floor(micros * sample_rate / 1e6 + 0.5);
+  return sample > (double) UINT32_MAX ? UINT32_MAX : (uint32_t) sample;
+}
+
+/*
+ * Parse a Standard MIDI File of type 0 or 1 that is already in memory
+ * into a song. The tracks are merged by tick and played as one, so a
+ * channel's program and controllers apply to its notes in any track and
+ * a note off may come from another track than its note on. Notes are
+ * timed in samples through the tempo map (or SMPTE time), and each
+ * channel's program picks the render_voice voice of its General MIDI
+ * family. Velocity, channel volume and expression set the
+ * amplitude, the pan controller the stereo position, and every note
+ * gets a short attack and release so it starts and stops without a
+ * click. The percussion channel is skipped, as there is no drum voice.
+ * The beat is a quarter note at the opening tempo.
+ * Calls fatal_error if the file is not a MIDI file this can read.
+ * Parameters:
+ *  data: the bytes of the file
+ *  size: the number of bytes
+ *  song: where the parsed song is stored; release it with song_free
+ */
+void midi_parse(const uint8_t data[], size_t size, Song *song) {
+  MidiScore score = { 0 };
+  MidiReader reader = { data, data + size, song };
+
+  song->events = NULL;
+  song->num_events = 0u;
+  song->max_events = 0u;
+  song->polyphony = SONG_POLYPHONY;
+  song->sample_rate = SAMPLES_PER_SECOND;
+  song->map = NULL;
+  song->map_size = 0u;
+
+  if (size < 14u || memcmp(data, "MThd", 4u) != 0) {  // Read the header chunk
+    midi_error(&score, song, "Not a MIDI file");
+  }
+  reader.pos += 4;
+  uint32_t header_size = midi_number(&reader, &score, 4u);
+  if (header_size < 6u) {
+    midi_error(&score, song, "Bad MIDI header");
+  }
+  unsigned type = midi_number(&reader, &score, 2u);
+  midi_number(&reader, &score, 2u);  // The track count; every MTrk chunk is read
+  unsigned division = midi_number(&reader, &score, 2u);
+  midi_skip(&reader, &score, header_size - 6u);
+  if (type > 1u) {
+    midi_error(&score, song, "Only MIDI file types 0 and 1 are supported");
+  }
+  if (division & 0x8000u) {  // SMPTE frames per second and ticks per frame
+    int fps = -(int8_t) (division >> 8);
+    double frames = fps == 29 ? 30000.0 / 1001.0 : fps;
+    if (fps <= 0 || (division & 0xFFu) == 0u) {
+      midi_error(&score, song, "Bad MIDI time division");
+    }
+    score.tick_micros = 1e6 / (frames * (division & 0xFFu));
+  }
+  else if (division == 0u) {
+    midi_error(&score, song, "Bad MIDI time division");
+  }
+  score.division = division;
+
+  add_tempo(&score, song, 0u, MIDI_TEMPO);
+  while (reader.end - reader.pos >= 8) {  // Read every track, skipping other chunks
+    const uint8_t *id = reader.pos;
+    reader.pos += 4;
+    uint32_t length = midi_number(&reader, &score, 4u);
+    if ((size_t) (reader.end - reader.pos) < length) {
+      midi_error(&score, song, "Truncated MIDI file");
+    }
+    if (memcmp(id, "MTrk", 4u) == 0) {
+      MidiReader track = { reader.pos, reader.pos + length, song };
+      read_track(&track, &score);
+    }
+    reader.pos += length;
+  }
+  sort_events(&score, song);
+  play_events(&score, song);
+  free(score.events);
+  score.events = NULL;
+
+  // Lay the tempo map out in time; a tempo set at tick 0 replaces the default
+  qsort(score.tempos, score.num_tempos, sizeof(MidiTempo), compare_tempos);
+  unsigned kept = 0u;
+  for (unsigned t = 0; t < score.num_tempos; t++) {
+    MidiTempo *change = &score.tempos[t];
+    if (change->tempo == 0u) {
+      continue;
+    }
+    if (kept > 0u && score.tempos[kept - 1].tick == change->tick) {
+      kept--;
+    }
+    score.tempos[kept] = *change;
+    score.tempos[kept].micros = kept == 0u ? 0.0 :
+      score.tempos[kept - 1].micros + (double) (change->tick - score.tempos[kept - 1].tick) *
+      score.tempos[kept - 1].tempo / score.division;
+    kept++;
+  }
+  score.num_tempos = kept;
+
+  uint32_t opening = score.tick_micros > 0.0 ? MIDI_TEMPO : score.tempos[0].tempo;
+  song->beat = (unsigned) ((uint64_t) opening * song->sample_rate / 1000000u);
+  song->num_samples = tick_to_sample(&score, song->sample_rate, score.last_tick);
+
+  song->events = malloc((score.num_notes ? score.num_notes : 1u) * sizeof(SongEvent));
+  if (song->events == NULL) {
+    midi_error(&score, song, "Cannot allocate song events");
+  }
+  song->max_events = score.num_notes;
+
+  SongEvent event;
+  event.attack = MIDI_ATTACK;
+  event.decay = 0u;
+  event.sustain = 1.0f;
+  event.release = MIDI_RELEASE;
+  for (unsigned n = 0; n < score.num_notes; n++) {  // Time every note in samples
+    const MidiNote *note = &score.notes[n];
+    event.start = tick_to_sample(&score, song->sample_rate, note->on);
+    event.length = tick_to_sample(&score, song->sample_rate, note->off) - event.start;
+    event.note = note->key;
+    event.voice = note->voice;
+    event.amplitude = note->amplitude;
+    event.pan = note->pan;
+    song->events[song->num_events++] = event;
+  }
+  if (score.num_notes > 0u) {
+    uint32_t end = song->events[song->num_events - 1].start;
+    for (unsigned e = 0; e < song->num_events; e++) {  // Leave room for the last release
+      uint32_t stop = song->events[e].start + song->events[e].length + MIDI_RELEASE;
+      end = stop > end ? stop : end;
+    }
+    song->num_samples = end > song->num_samples ? end : song->num_samples;
+  }
+
+  free(score.tempos);
+  free(score.notes);
+  song_sort(song);
+}
@@ -0,0 +1,18 @@
+#ifndef MIDI_H
+#define MIDI_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "song.h"
+
+#define MIDI_CHANNELS  16u
+#define MIDI_DRUMS     9u        /* channel 10, General MIDI percussion, which is skipped */
+#define MIDI_TEMPO     500000u   /* microseconds per quarter note until a tempo event (120 bpm) */
+#define MIDI_VOLUME    100u      /* channel volume until a volume controller */
+#define MIDI_AMPLITUDE 0.1f      /* amplitude of a full velocity note at full volume */
+#define MIDI_ATTACK    220u      /* samples each note fades in over, 5 ms */
+#define MIDI_RELEASE   882u      /* samples each note fades out over after its note off, 20 ms */
+
+void midi_parse(const uint8_t data[], size_t size, Song *song);
+
+#endif /* MIDI_H */
@@ -0,0 +1,196 @@
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "mix.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MIX_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Add src[] into dst[] one sample at a time, saturating each sum
+ * to the int16_t range. This is the portable path and the reference
+ * the vector paths must match bit for bit.
+ * Parameters:
+ *  dst: the samples to mix into
+ *  src: the samples to add
+ *  n: the number of samples in both buffers
+ */
+void mix_s16_scalar(int16_t dst[], const int16_t src[], unsigned n) {
+  for (unsigned i = 0; i < n; i++) {
+    int sum = (int) dst[i] + (int) src[i];
+    sum = sum > INT16_MAX ? INT16_MAX : sum;
+    sum = sum < INT16_MIN ? INT16_MIN : sum;
+    dst[i] = (int16_t) sum;
+  }
+}
+
+#ifdef MIX_X86
+/*
+ * SSE2 version of mix_s16_scalar, eight samples per instruction.
+ */
+__attribute__((target("sse2")))
+static void mix_s16_sse2(int16_t dst[], const int16_t src[], unsigned n) {
+  unsigned i = 0;
+  for (; i + 8u <= n; i += 8u) {
+    __m128i a = _mm_loadu_si128((const __m128i *) &dst[i]);
+    __m128i b = _mm_loadu_si128((const __m128i *) &src[i]);
+    _mm_storeu_si128((__m128i *) &dst[i], _mm_adds_epi16(a, b));
+  }
+  mix_s16_scalar(&dst[i], &src[i], n - i);
+}
+
+/*
+ * AVX2 version of mix_s16_scalar, sixteen samples per instruction.
+ */
+__attribute__((target("avx2")))
+static void mix_s16_avx2(int16_t dst[], const int16_t src[], unsigned n) {
+  unsigned i = 0;
+  for (; i + 16u <= n; i += 16u) {
+    __m256i a = _mm256_loadu_si256((const __m256i *) &dst[i]);
+    __m256i b = _mm256_loadu_si256((const __m256i *) &src[i]);
+    _mm256_storeu_si256((__m256i *) &dst[i], _mm256_adds_epi16(a, b));
+  }
+  _mm256_zeroupper();  // Avoid AVX to SSE transition stalls in the caller
+  mix_s16_scalar(&dst[i], &src[i], n - i);
+}
+#endif
+
+/*
+ * Add src[] into dst[], saturating each sum to the int16_t range.
+ * The fastest path the running CPU supports is chosen at runtime.
+ * Parameters:
+ *  dst: the samples to mix into
+ *  src: the samples to add
+ *  n: the number of samples in both buffers
+ */
+void mix_s16(int16_t dst[], const int16_t src[], unsigned n) {
+#ifdef MIX_X86
+  if (__builtin_cpu_supports("avx2")) {
+    mix_s16_avx2(dst, src, n);
+    return;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    mix_s16_sse2(dst, src, n);
+    return;
+  }
+#endif
+  mix_s16_scalar(dst, src, n);
+}
+
+/*
+ * Return the name of the path mix_s16 uses on the running CPU.
+ */
+const char *mix_s16_path(void) {
+#ifdef MIX_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return "avx2";
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return "sse2";
+  }
+#endif
+  return "scalar";
+}
+
+/*
+ * Convert a float mix bus to int16_t, truncating toward zero and
+ * saturating values outside the int16_t range.
+ * Parameters:
+ *  dst: where the converted samples are stored
+ *  src: the mix bus
+ *  n: the number of samples in both buffers
+ */
+void mix_f32_to_s16(int16_t dst[], const float src[], unsigned n) {
+  for (unsigned i = 0; i < n; i++) {
+    float value = src[i];
+    value = value > (float) INT16_MAX ? (float) INT16_MAX : value;
+    value = value < (float) INT16_MIN ? (float) INT16_MIN : value;
+    dst[i] = (int16_t) value;
+  }
+}
+
+/*
+ * Return the next value of a xorshift32 generator.
+ */
+static uint32_t xorshift32(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+/*
+ * Convert a float mix bus to int16_t with TPDF dither: triangular
+ * noise of up to one step either way is added before rounding to
+ * the nearest value, which turns quantization error into a steady
+ * noise floor instead of distortion that follows the signal.
+ * The noise depends only on seed, so a block always dithers the same
+ * way however the render was split up.
+ * Parameters:
+ *  dst: where the converted samples are stored
+ *  src: the mix bus
+ *  n: the number of samples in both buffers
+ *  seed: the noise seed, for example the position of the block
+ */
+void mix_f32_to_s16_tpdf(int16_t dst[], const float src[], unsigned n,
+                         uint32_t seed) {
+  uint32_t state = seed * 2654435761u + 0x9E3779B9u;
+  if (state == 0u) {
+    state = 1u;
+  }
+
+  for (unsigned i = 0; i < n; i++) {
+    float r1 = (float) (xorshift32(&state) >> 8) * (1.0f / 16777216.0f);
+    float r2 = (float) (xorshift32(&state) >> 8) * (1.0f / 16777216.0f);
+    float value = floorf(src[i] + (r1 - r2) + 0.5f);
+    value = value > (float) INT16_MAX ? (float) INT16_MAX : value;
+    value = value < (float) INT16_MIN ? (float) INT16_MIN : value;
+    dst[i] = (int16_t) value;
+  }
+}
+
+/*
+ * Convert a float mix bus, in 16 bit sample units, to packed 24 bit
+ * little endian samples. Values are scaled by 256, truncated toward
+ * zero and clamped like mix_f32_to_s16, so a 24 bit render carries
+ * the same signal with eight more bits below it.
+ * Parameters:
+ *  dst: where the 3 * n bytes of converted samples are stored
+ *  src: the mix bus
+ *  n: the number of samples in src
+ */
+void mix_f32_to_s24(uint8_t dst[], const float src[], unsigned n) {
+  for (unsigned i = 0; i < n; i++) {
+    float value = src[i] * 256.0f;
+    value = value > 8388607.0f ? 8388607.0f : value;
+    value = value < -8388608.0f ? -8388608.0f : value;
+    uint32_t bits = (uint32_t) (int32_t) value;
+    dst[3 * i] = bits & 0xFF;
+    dst[3 * i + 1] = (bits >> 8) & 0xFF;
+    dst[3 * i + 2] = (bits >> 16) & 0xFF;
+  }
+}
+
+/*
+ * Convert a float mix bus, in 16 bit sample units, to little endian
+ * 32 bit float samples where 1.0 is full scale. Nothing is clamped.
+ * Parameters:
+ *  dst: where the 4 * n bytes of converted samples are stored
+ *  src: the mix bus
+ *  n: the number of samples in src
+ */
+void mix_f32_to_f32(uint8_t dst[], const float src[], unsigned n) {
+  for (unsigned i = 0; i < n; i++) {
+    float value = src[i] * (1.0f / 32768.0f);
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    dst[4 * i] = bits & 0xFF;
+    dst[4 * i + 1] = (bits >> 8) & 0xFF;
+    dst[4 * i + 2] = (bits >> 16) & 0xFF;
+    dst[4 * i + 3] = (bits >> 24) & 0xFF;
+  }
+}
@@ -0,0 +1,17 @@
+#ifndef MIX_H
+#define MIX_H
+
+#include <stdint.h>
+
+#define MIX_BLOCK 4096u /* stereo samples per float mix bus block */
+
+void mix_s16(int16_t dst[], const int16_t src[], unsigned n);
+void mix_s16_scalar(int16_t dst[], const int16_t src[], unsigned n);
+const char *mix_s16_path(void);
+void mix_f32_to_s16(int16_t dst[], const float src[], unsigned n);
+void mix_f32_to_s16_tpdf(int16_t dst[], const float src[], unsigned n,
+  uint32_t seed);
+void mix_f32_to_s24(uint8_t dst[], const float src[], unsigned n);
+void mix_f32_to_f32(uint8_t dst[], const float src[], unsigned n);
+
+#endif /* MIX_H */
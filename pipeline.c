@@ -0,0 +1,273 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "io.h"
+#include "pipeline.h"
+#include "stats.h"
+
+/*
+ * The buffers form a ring that every block passes through in order:
+ * the reader fills slot n % PIPE_SLOTS, the effect processes it and
+ * the writer writes it, after which the reader may reuse it. Each
+ * stage owns one counter of blocks it has finished and only reads the
+ * others, so the three stages form a chain of lock-free single
+ * producer, single consumer queues.
+ */
+typedef struct {
+  PipeSource read;               /* where blocks come from */
+  void *source;                  /* passed to read */
+  FILE *out;
+  unsigned num_samples;          /* (stereo) samples the input should hold */
+  unsigned block;                /* (stereo) samples per buffer */
+  int16_t *buffers;              /* PIPE_SLOTS buffers of block stereo samples */
+  unsigned counts[PIPE_SLOTS];   /* (stereo) samples held by each buffer */
+  unsigned filled;               /* blocks read, owned by the reader */
+  unsigned processed;            /* blocks processed, owned by the effect */
+  unsigned written;              /* blocks written, owned by the writer */
+  int read_done;                 /* set once filled is final */
+  int process_done;              /* set once processed is final */
+  unsigned total;                /* (stereo) samples written */
+  PipeEffect effect;
+  void *state;
+} Pipeline;
+
+/*
+ * Return the value of a counter another stage publishes.
+ */
+static unsigned load_counter(const unsigned *counter) {
+  return __atomic_load_n(counter, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Publish a new value of a counter this stage owns.
+ */
+static void store_counter(unsigned *counter, unsigned value) {
+  __atomic_store_n(counter, value, __ATOMIC_RELEASE);
+}
+
+/*
+ * Wait until the previous stage has finished more than n blocks.
+ * Returns 0 if it is done and will not finish any more.
+ */
+static int wait_ahead(const unsigned *counter, const int *done, unsigned n) {
+  for (;;) {
+    int finished = __atomic_load_n(done, __ATOMIC_ACQUIRE);
+    if (load_counter(counter) > n) {
+      return 1;
+    }
+    if (finished) {
+      return 0;
+    }
+    sched_yield();
+  }
+}
+
+/*
+ * Return the buffer of slot n.
+ */
+static int16_t *slot_buffer(const Pipeline *pipe, unsigned n) {
+  return &pipe->buffers[(size_t) (n % PIPE_SLOTS) * pipe->block * 2];
+}
+
+/*
+ * Source that reads blocks straight from a file.
+ */
+static unsigned read_file(void *source, int16_t samples[], unsigned num_samples) {
+  return read_s16_buf(source, samples, 2 * num_samples) / 2;
+}
+
+/*
+ * Read a block from the pipeline's source, timing it as the read stage.
+ */
+static unsigned read_block(const Pipeline *pipe, int16_t samples[], unsigned num_samples) {
+  StatsMark mark;
+  stats_start(&mark);
+  unsigned got = pipe->read(pipe->source, samples, num_samples);
+  stats_stop(&mark, STAGE_READ);
+  return got;
+}
+
+/*
+ * Write a block to the pipeline's output, timing it as the write stage.
+ */
+static void write_block(const Pipeline *pipe, const int16_t samples[], unsigned num_samples) {
+  StatsMark mark;
+  stats_start(&mark);
+  write_s16_buf(pipe->out, samples, 2 * num_samples);
+  stats_stop(&mark, STAGE_WRITE);
+  stats_add_output(num_samples, 4u * num_samples);
+}
+
+/*
+ * Read blocks into the ring until the input ends, waiting whenever
+ * every slot is still in use downstream.
+ */
+static void *reader_stage(void *arg) {
+  Pipeline *pipe = arg;
+  unsigned position = 0;
+
+  for (unsigned n = 0; position < pipe->num_samples; n++) {
+    while (n - load_counter(&pipe->written) >= PIPE_SLOTS) {  // Wait for a free slot
+      sched_yield();
+    }
+
+    unsigned count = pipe->num_samples - position < pipe->block ?
+      pipe->num_samples - position : pipe->block;
+    unsigned got = read_block(pipe, slot_buffer(pipe, n), count);
+    if (got == 0) {
+      break;
+    }
+    pipe->counts[n % PIPE_SLOTS] = got;
+    store_counter(&pipe->filled, n + 1);
+    position += got;
+    if (got < count) {  // The input ended early
+      break;
+    }
+  }
+
+  __atomic_store_n(&pipe->read_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/*
+ * Run the effect on each block the reader has filled.
+ */
+static void *effect_stage(void *arg) {
+  Pipeline *pipe = arg;
+  unsigned position = 0;
+
+  for (unsigned n = 0; wait_ahead(&pipe->filled, &pipe->read_done, n); n++) {
+    unsigned count = pipe->counts[n % PIPE_SLOTS];
+    pipe->effect(pipe->state, slot_buffer(pipe, n), count, position);
+    position += count;
+    store_counter(&pipe->processed, n + 1);
+  }
+
+  __atomic_store_n(&pipe->process_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/*
+ * Write each processed block and hand its slot back to the reader.
+ */
+static void *writer_stage(void *arg) {
+  Pipeline *pipe = arg;
+
+  for (unsigned n = 0; wait_ahead(&pipe->processed, &pipe->process_done, n); n++) {
+    unsigned count = pipe->counts[n % PIPE_SLOTS];
+    write_block(pipe, slot_buffer(pipe, n), count);
+    pipe->total += count;
+    store_counter(&pipe->written, n + 1);
+  }
+  return NULL;
+}
+
+/*
+ * Stream num_samples (stereo) samples from in through an effect to out,
+ * one block at a time, so memory use does not depend on the length of
+ * the stream. The caller writes any header before and after.
+ * Parameters:
+ *  in: the input stream, positioned at the first sample
+ *  out: the output stream
+ *  num_samples: the number of (stereo) samples to process
+ *  block: the number of (stereo) samples per block
+ *  effect: the function run on each block
+ *  state: passed to effect
+ *  threaded: nonzero to read and write on their own threads, so disk I/O
+ *            overlaps with the effect
+ * Returns the number of (stereo) samples written, which is less than
+ * num_samples only if the input was truncated.
+ */
+unsigned pipeline_run(FILE *in, FILE *out, unsigned num_samples,
+                      unsigned block, PipeEffect effect, void *state,
+                      int threaded) {
+  return pipeline_run_source(read_file, in, out, num_samples, block, effect, state, threaded);
+}
+
+/*
+ * Like pipeline_run, but blocks come from a source function instead of
+ * a file, so a stage such as a resampler can run ahead of the effect;
+ * with threaded it runs on the reader thread.
+ * Parameters:
+ *  read: the function that produces each block
+ *  source: passed to read
+ *  the rest: as for pipeline_run
+ */
+unsigned pipeline_run_source(PipeSource read, void *source, FILE *out,
+                             unsigned num_samples, unsigned block,
+                             PipeEffect effect, void *state, int threaded) {
+  Pipeline pipe = { 0 };
+  pipe.read = read;
+  pipe.source = source;
+  pipe.out = out;
+  pipe.num_samples = num_samples;
+  pipe.block = block;
+  pipe.effect = effect;
+  pipe.state = state;
+  pipe.buffers = malloc((size_t) (threaded ? PIPE_SLOTS : 1u) * block * 2 * sizeof(int16_t));
+  if (pipe.buffers == NULL) {
+    fatal_error("Cannot allocate pipeline buffers");
+  }
+
+  if (!threaded) {  // Read, process and write each block in turn
+    for (unsigned position = 0; position < num_samples; ) {
+      unsigned count = num_samples - position < block ? num_samples - position : block;
+      unsigned got = read_block(&pipe, pipe.buffers, count);
+      effect(state, pipe.buffers, got, position);
+      write_block(&pipe, pipe.buffers, got);
+      position += got;
+      pipe.total += got;
+      if (got < count) {  // The input ended early
+        break;
+      }
+    }
+  }
+  else {
+    pthread_t reader, writer;
+    if (pthread_create(&reader, NULL, reader_stage, &pipe) != 0 ||
+        pthread_create(&writer, NULL, writer_stage, &pipe) != 0) {
+      fatal_error("Cannot start pipeline thread");
+    }
+    effect_stage(&pipe);
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+  }
+
+  free(pipe.buffers);
+  return pipe.total;
+}
+
+/*
+ * Run an effect over sample data that is already in memory, such as
+ * mapped files, one block at a time. Each block is copied from in to
+ * out and processed in place there; in and out may be the same.
+ * Parameters:
+ *  in: the input samples
+ *  out: where the processed samples go
+ *  num_samples: the number of (stereo) samples to process
+ *  block: the number of (stereo) samples per block
+ *  effect: the function run on each block
+ *  state: passed to effect
+ * Returns the number of (stereo) samples written, num_samples.
+ */
+unsigned pipeline_run_mapped(const int16_t in[], int16_t out[],
+                             unsigned num_samples, unsigned block,
+                             PipeEffect effect, void *state) {
+  for (unsigned position = 0; position < num_samples; position += block) {
+    unsigned count = num_samples - position < block ? num_samples - position : block;
+    StatsMark mark;
+    stats_start(&mark);
+    if (in != out) {
+      memcpy(&out[2 * (size_t) position], &in[2 * (size_t) position], 2 * count * sizeof(int16_t));
+    }
+    stats_stop(&mark, STAGE_READ);
+    effect(state, &out[2 * (size_t) position], count, position);
+    stats_add_output(count, 4u * count);
+  }
+  return num_samples;
+}
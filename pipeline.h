@@ -0,0 +1,33 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define PIPE_SLOTS 8u /* buffers in flight between the pipeline stages */
+
+/*
+ * An effect run on each block of a pipeline. It processes num_samples
+ * interleaved stereo samples in place; position is the index of the
+ * block's first sample in the stream.
+ */
+typedef void (*PipeEffect)(void *state, int16_t samples[],
+  unsigned num_samples, unsigned position);
+
+/*
+ * A source of blocks for a pipeline. It stores up to num_samples
+ * interleaved stereo samples and returns how many it stored, fewer
+ * only once its input has ended.
+ */
+typedef unsigned (*PipeSource)(void *source, int16_t samples[],
+  unsigned num_samples);
+
+unsigned pipeline_run(FILE *in, FILE *out, unsigned num_samples,
+  unsigned block, PipeEffect effect, void *state, int threaded);
+unsigned pipeline_run_source(PipeSource read, void *source, FILE *out,
+  unsigned num_samples, unsigned block, PipeEffect effect, void *state,
+  int threaded);
+unsigned pipeline_run_mapped(const int16_t in[], int16_t out[],
+  unsigned num_samples, unsigned block, PipeEffect effect, void *state);
+
+#endif /* PIPELINE_H */
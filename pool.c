@@ -0,0 +1,164 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "io.h"
+#include "pool.h"
+
+/*
+ * Every worker starts with an even share of the jobs as a range of
+ * job numbers. The range is a deque packed into one 64 bit word, the
+ * next job in the low half and the end in the high half: the owner
+ * takes jobs from the front and idle workers steal from the back,
+ * each with one compare and swap, so no lock is ever taken.
+ */
+typedef struct {
+  uint64_t range;       /* next job | end << 32 */
+  char pad[56];         /* keep each range on its own cache line */
+} PoolDeque;
+
+typedef struct {
+  PoolDeque *deques;
+  unsigned num_threads;
+  PoolJob job;
+  void *context;
+} Pool;
+
+/* what a worker thread needs to know */
+typedef struct {
+  Pool *pool;
+  unsigned worker;
+} PoolWorker;
+
+/*
+ * Take the next job from the front of a worker's own deque.
+ * Returns 0 if the deque is empty.
+ */
+static int pool_pop(PoolDeque *deque, unsigned *index) {
+  uint64_t range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+  for (;;) {
+    uint32_t next = (uint32_t) range, end = (uint32_t) (range >> 32);
+    if (next >= end) {
+      return 0;
+    }
+    uint64_t taken = (uint64_t) end << 32 | (next + 1u);
+    if (__atomic_compare_exchange_n(&deque->range, &range, taken, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      *index = next;
+      return 1;
+    }
+  }
+}
+
+/*
+ * Steal the last job from the back of another worker's deque.
+ * Returns 0 if the deque is empty.
+ */
+static int pool_steal(PoolDeque *deque, unsigned *index) {
+  uint64_t range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+  for (;;) {
+    uint32_t next = (uint32_t) range, end = (uint32_t) (range >> 32);
+    if (next >= end) {
+      return 0;
+    }
+    uint64_t taken = (uint64_t) (end - 1u) << 32 | next;
+    if (__atomic_compare_exchange_n(&deque->range, &range, taken, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      *index = end - 1u;
+      return 1;
+    }
+  }
+}
+
+/*
+ * Run jobs from the worker's own deque, then steal from the others
+ * until every deque is empty.
+ */
+static void *pool_worker(void *arg) {
+  PoolWorker *self = arg;
+  Pool *pool = self->pool;
+  unsigned index;
+
+  for (;;) {
+    if (pool_pop(&pool->deques[self->worker], &index)) {
+      pool->job(pool->context, index, self->worker);
+      continue;
+    }
+
+    int stole = 0;
+    for (unsigned k = 1; k < pool->num_threads && !stole; k++) {  // Look for work, nearest worker first
+      unsigned victim = (self->worker + k) % pool->num_threads;
+      if (pool_steal(&pool->deques[victim], &index)) {
+        pool->job(pool->context, index, self->worker);
+        stole = 1;
+      }
+    }
+    if (!stole) {  // Jobs are never added, so empty deques stay empty
+      return NULL;
+    }
+  }
+}
+
+/*
+ * Run num_jobs jobs on a pool of worker threads and wait for all of
+ * them. Each worker starts on its own contiguous share of the jobs
+ * and steals from the others once its share is done, so long and
+ * short jobs even out without a shared queue.
+ * Parameters:
+ *  num_jobs: the number of jobs
+ *  num_threads: the number of worker threads; 1 runs the jobs in
+ *               order on the calling thread
+ *  job: the function called for each job, with the job's number and
+ *       the number of the worker running it
+ *  context: passed to job
+ */
+void pool_run(unsigned num_jobs, unsigned num_threads, PoolJob job,
+              void *context) {
+  pthread_t threads[POOL_MAX_THREADS];
+  PoolWorker workers[POOL_MAX_THREADS];
+
+  if (num_threads < 1u) {
+    num_threads = 1u;
+  }
+  else if (num_threads > POOL_MAX_THREADS) {
+    num_threads = POOL_MAX_THREADS;
+  }
+  if (num_threads > num_jobs && num_jobs > 0u) {
+    num_threads = num_jobs;
+  }
+
+  Pool pool;
+  pool.deques = calloc(num_threads, sizeof(PoolDeque));
+  if (pool.deques == NULL) {
+    fatal_error("Cannot allocate thread pool");
+  }
+  pool.num_threads = num_threads;
+  pool.job = job;
+  pool.context = context;
+
+  for (unsigned t = 0; t < num_threads; t++) {  // Deal out even shares
+    uint64_t first = (uint64_t) num_jobs * t / num_threads;
+    uint64_t end = (uint64_t) num_jobs * (t + 1u) / num_threads;
+    pool.deques[t].range = end << 32 | first;
+    workers[t].pool = &pool;
+    workers[t].worker = t;
+  }
+
+  if (num_threads == 1u) {
+    pool_worker(&workers[0]);
+  }
+  else {
+    for (unsigned t = 0; t < num_threads; t++) {
+      if (pthread_create(&threads[t], NULL, pool_worker, &workers[t]) != 0) {
+        fatal_error("Cannot start pool thread");
+      }
+    }
+    for (unsigned t = 0; t < num_threads; t++) {
+      pthread_join(threads[t], NULL);
+    }
+  }
+
+  free(pool.deques);
+}
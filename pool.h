@@ -0,0 +1,12 @@
+#ifndef POOL_H
+#define POOL_H
+
+#define POOL_MAX_THREADS 256u /* most worker threads pool_run will start */
+
+/* one job of a pool run: index is the job's number, 0 to num_jobs - 1 */
+typedef void (*PoolJob)(void *context, unsigned index, unsigned worker);
+
+void pool_run(unsigned num_jobs, unsigned num_threads, PoolJob job,
+  void *context);
+
+#endif /* POOL_H */
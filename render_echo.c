@@ -1,21 +1,286 @@
 // Jack Tarantino - jtarant3
 // Weina Dai - wdai11
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
 #include "io.h"
 #include "wave.h"
+#include "mix.h"
+#include "convolve.h"
+#include "delay.h"
+#include "pipeline.h"
+#include "wavemap.h"
+#include "resample.h"
+#include "stats.h"
 #include <math.h>
 
 
 /* 
  *need to open the input file, call read_wave_header to read the WAVE header an *d get the number of (stereo) samples, then read the sample data into an array *Adding the echo effe * ct can be accomplished by adding attenuated sample values *to the sample value at a later audio position
+ * Each block of output is mixed in a float bus and converted to
+ * 16 bits once, with TPDF dither when -d is given.
+ * With -r the single echo is replaced by convolution with the
+ * impulse response in the given WAVE file (a reverb), computed with
+ * partitioned overlap-add FFT convolution.
+ * The input may have any sample rate but must be 16 bit stereo; the
+ * output has the same sample rate and delays count samples at it.
+ * With -R the input is first resampled to the given rate by a
+ * polyphase windowed-sinc filter, with -q fast, medium (the default)
+ * or best quality; this runs as the first stage of the streaming
+ * pipeline.
+ * Several delay/amplitude pairs give several echoes, and -f feeds
+ * the longest echo back into the delay line with the given gain.
+ * When both files are regular files they are memory mapped and the
+ * effect runs in place on the output's sample data; otherwise (pipes,
+ * devices) the input is streamed through the effect one block at a
+ * time. Either way memory use does not depend on the length of the
+ * input. With -t the streaming path is always used, with reading and
+ * writing on their own threads.
+ * With --stats the wall and CPU time of each stage, the throughput and
+ * the peak memory use are printed to stderr at the end; --stats=json
+ * prints them as one line of JSON.
+ * Usage: render_echo [-d] [-t] [--stats] [-R rate [-q quality]] [-f feedback]
+ *          input.wav output.wav delay amplitude [delay amplitude ...]
+ *        render_echo [-d] [-t] [--stats] [-R rate [-q quality]] -r impulse.wav
+ *          input.wav output.wav amplitude
+ */
+
+/* state of the delay effect */
+typedef struct {
+  DelayLine line;
+  int dither;
+  float bus[2 * MIX_BLOCK];
+} DelayEffect;
+
+/* input stage that resamples the input file */
+typedef struct {
+  FILE *in;
+  Resampler rs;
+  unsigned left;      /* input frames not read yet */
+  int finished;       /* set once the resampler has all the input */
+  int16_t staging[2 * RS_CHUNK];
+} ResampleSource;
+
+/* state of the reverb effect */
+typedef struct {
+  Convolver conv;
+  float wet;      /* gain of the reverb added to the dry signal */
+  int dither;
+  float *in;      /* one partition of input */
+  float *bus;     /* one partition of output */
+} ReverbEffect;
+
+/*
+ * This function converts a float bus back to samples, with dither
+ * if requested.
+ */
+static void convert_block(int16_t samples[], const float bus[], unsigned count,
+                          unsigned position, int dither) {
+  if (dither) {
+    mix_f32_to_s16_tpdf(samples, bus, 2 * count, position);
+  }
+  else {
+    mix_f32_to_s16(samples, bus, 2 * count);
+  }
+}
+
+/*
+ * This function runs a block of at most MIX_BLOCK samples through
+ * the delay line.
+ */
+static void delay_effect(void *state, int16_t samples[], unsigned count,
+                         unsigned position) {
+  DelayEffect *effect = state;
+  StatsMark mark;
+
+  stats_start(&mark);
+  for (unsigned j = 0; j < 2 * count; j++) {
+    effect->bus[j] = samples[j];
+  }
+  delay_process(&effect->line, effect->bus, effect->bus, count);
+  stats_lap(&mark, STAGE_RENDER);
+  convert_block(samples, effect->bus, count, position, effect->dither);
+  stats_stop(&mark, STAGE_MIX);
+}
+
+/*
+ * This function adds the reverb of a block of at most one partition
+ * to it.
  */
+static void reverb_effect(void *state, int16_t samples[], unsigned count,
+                          unsigned position) {
+  ReverbEffect *effect = state;
+  unsigned block = effect->conv.block;
+  StatsMark mark;
+
+  stats_start(&mark);
+  for (unsigned j = 0; j < 2 * block; j++) {  // Zero pad a short last block
+    effect->in[j] = j < 2 * count ? samples[j] : 0.0f;
+  }
+  conv_process(&effect->conv, effect->in, effect->bus);
+  for (unsigned j = 0; j < 2 * count; j++) {  // Add the reverb to the dry signal
+    effect->bus[j] = effect->in[j] + effect->wet * effect->bus[j];
+  }
+  stats_lap(&mark, STAGE_RENDER);
+  convert_block(samples, effect->bus, count, position, effect->dither);
+  stats_stop(&mark, STAGE_MIX);
+}
+
+/*
+ * This function reads the header of a 16 bit stereo WAVE file at any
+ * sample rate and stores its sample rate and number of (stereo)
+ * samples.
+ */
+static void read_stereo_header(FILE *in, uint32_t *rate, unsigned *num_samples) {
+  WaveFormat format;
+  read_wave_format(in, &format);
+  if (format.format != WAVE_FORMAT_PCM || format.bits_per_sample != 16u) {
+    fatal_error("Bad wave header (samples are not 16 bit PCM)");
+  }
+  if (format.channels != 2u) {
+    fatal_error("Bad wave header (NumChannels is not 2)");
+  }
+  *rate = format.sample_rate;
+  *num_samples = format.data_size / 4u;
+}
+
+/*
+ * This function sets up the reverb effect for the impulse response
+ * in irname, which must have the input's sample rate.
+ */
+static void reverb_init(ReverbEffect *effect, const char *irname, float wet,
+                        int dither, uint32_t rate) {
+  FILE * irfile = fopen(irname, "rb");  // Read in the whole impulse response
+  if (irfile == NULL) {
+    fatal_error("Cannot open impulse response file");
+  }
+  unsigned irsamples;
+  uint32_t irrate;
+  read_stereo_header(irfile, &irrate, &irsamples);
+  if (irrate != rate) {
+    fatal_error("Impulse response and input sample rates differ");
+  }
+  int16_t * ir = calloc((size_t) irsamples * 2 + 2, sizeof(int16_t));
+  if (ir == NULL) {
+    fatal_error("Cannot allocate impulse response");
+  }
+  irsamples = read_s16_buf(irfile, ir, irsamples * 2) / 2;
+  fclose(irfile);
+
+  conv_init(&effect->conv, ir, irsamples);
+  free(ir);
+
+  effect->wet = wet;
+  effect->dither = dither;
+  effect->in = malloc(2 * effect->conv.block * sizeof(float));
+  effect->bus = malloc(2 * effect->conv.block * sizeof(float));
+  if (effect->in == NULL || effect->bus == NULL) {
+    fatal_error("Cannot allocate reverb buffers");
+  }
+}
+
+/*
+ * This function is the pipeline source that reads the input file
+ * through the resampler.
+ */
+static unsigned resample_read(void *source, int16_t samples[], unsigned num_samples) {
+  ResampleSource *src = source;
+  unsigned done = 0;
+
+  for (;;) {
+    done += rs_pull(&src->rs, &samples[2 * done], num_samples - done);
+    if (done == num_samples || src->finished) {
+      return done;
+    }
+
+    unsigned want = rs_space(&src->rs);  // Feed the resampler another chunk of input
+    want = want < RS_CHUNK ? want : RS_CHUNK;
+    want = want < src->left ? want : src->left;
+    unsigned got = read_s16_buf(src->in, src->staging, 2 * want) / 2;
+    rs_push(&src->rs, src->staging, got);
+    src->left -= got;
+    if (got < want || src->left == 0) {
+      rs_finish(&src->rs);
+      src->finished = 1;
+    }
+  }
+}
+
+/*
+ * This function returns nonzero if the file named outname exists and
+ * is the open input file, which opening it for output would truncate.
+ */
+static int same_file(FILE *in, const char *outname) {
+  struct stat instat, outstat;
+  return fstat(fileno(in), &instat) == 0 && stat(outname, &outstat) == 0 &&
+    instat.st_dev == outstat.st_dev && instat.st_ino == outstat.st_ino;
+}
 
 int main(int argc, char *argv[]) {
 
-  if (argc < 5) {   // Check for proper number of command line inputs
+  int dither = 0;  // Whether to dither the final conversion
+  int threaded = 0;  // Whether to read and write on their own threads
+  const char *irname = NULL;  // Impulse response for the reverb, if any
+  float feedback = 0.0f;  // Feedback gain of the delay line
+  unsigned outrate = 0;  // Rate to resample the input to, 0 for none
+  unsigned quality = RS_MEDIUM;  // Resampler quality preset
+  int arg = 1;  // Index of the first argument that is not an option
+  while (arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0') {  // Read the options
+    if (strcmp(argv[arg], "-d") == 0) {
+      dither = 1;
+      arg++;
+    }
+    else if (stats_option(argv[arg])) {
+      arg++;
+    }
+    else if (strcmp(argv[arg], "-t") == 0) {
+      threaded = 1;
+      arg++;
+    }
+    else if (strcmp(argv[arg], "-r") == 0 && arg + 1 < argc) {
+      irname = argv[arg + 1];
+      arg += 2;
+    }
+    else if (strcmp(argv[arg], "-R") == 0 && arg + 1 < argc) {
+      if (sscanf(argv[arg + 1], "%u", &outrate) != 1 || outrate < 1000 || outrate > 384000) {  // Check for a sensible sample rate
+        fatal_error("Invalid sample rate");
+      }
+      arg += 2;
+    }
+    else if (strcmp(argv[arg], "-q") == 0 && arg + 1 < argc) {
+      if (strcmp(argv[arg + 1], "fast") == 0) {
+        quality = RS_FAST;
+      }
+      else if (strcmp(argv[arg + 1], "medium") == 0) {
+        quality = RS_MEDIUM;
+      }
+      else if (strcmp(argv[arg + 1], "best") == 0) {
+        quality = RS_BEST;
+      }
+      else {
+        fatal_error("Invalid resampler quality");
+      }
+      arg += 2;
+    }
+    else if (strcmp(argv[arg], "-f") == 0 && arg + 1 < argc) {
+      if (sscanf(argv[arg + 1], "%f", &feedback) != 1) {  // Check that float was entered for the feedback value
+        fatal_error("Invalid feedback");
+      }
+      arg += 2;
+    }
+    else {
+      fatal_error("Invalid option");
+    }
+  }
+  argv += arg - 1;  // Let the positional arguments start at argv[1]
+  argc -= arg - 1;
+
+  if (irname ? argc < 4 : (argc < 5 || (argc - 3) % 2 != 0)) {   // Check for proper number of command line inputs
     fatal_error("Invalid number of inputs");
     
   }
@@ -25,54 +290,142 @@ int main(int argc, char *argv[]) {
     fatal_error("Cannot open input file");
   }
 
-  int delay;
-  if (sscanf(argv[3], "%d", &delay) != 1) {  // Check that int was read in for delay value
-    fatal_error("Invalid delay number");
+  float echoamp = 0.0f;
+  if (irname && sscanf(argv[3], "%f", &echoamp) != 1) {  // Check that float was entered for the echoamp value
+    fatal_error("Invalid amplitude");
   }
 
-  float echoamp;
-  if (sscanf(argv[4], "%f", &echoamp) != 1) {  // Check that float was entered for the echoamp value
-    fatal_error("Invalid amplitude");
+  DelayTap taps[DELAY_MAX_TAPS];
+  unsigned numtaps = 0;
+  for (int a = 3; !irname && a + 1 < argc; a += 2) {  // Read each delay and amplitude pair
+    int delay;
+    if (numtaps == DELAY_MAX_TAPS) {
+      fatal_error("Too many delay taps");
+    }
+    if (sscanf(argv[a], "%d", &delay) != 1 || delay < 0) {  // Check that a non-negative int was read in for delay value
+      fatal_error("Invalid delay number");
+    }
+    if (sscanf(argv[a + 1], "%f", &taps[numtaps].gain) != 1) {  // Check that float was entered for the echoamp value
+      fatal_error("Invalid amplitude");
+    }
+    taps[numtaps++].delay = (unsigned) delay;
   }
 
   unsigned numsamples;
-  read_wave_header(wavefilein, &numsamples);  // Obtain number of samples from the wave file header
+  uint32_t rate;
+  StatsMark mark;
+  stats_start(&mark);
+  read_stereo_header(wavefilein, &rate, &numsamples);  // Obtain number of samples from the wave file header
+  stats_stop(&mark, STAGE_PARSE);
 
-  int16_t * buf = calloc((size_t) (numsamples * 2), sizeof(int16_t));  // Allocate memory and initialize buf array to zero
-  read_s16_buf(wavefilein, buf, numsamples * 2);  // Read in values to buf array
+  ResampleSource *resample = NULL;  // Resampling stage, if the rate changes
+  if (outrate != 0 && outrate != rate) {
+    resample = malloc(sizeof(ResampleSource));
+    if (resample == NULL) {
+      fatal_error("Cannot allocate resampler");
+    }
+    rs_init(&resample->rs, rate, outrate, quality);
+    resample->in = wavefilein;
+    resample->left = numsamples;
+    resample->finished = 0;
+    numsamples = rs_output_frames(&resample->rs, numsamples);
+    rate = outrate;
+  }
+  WaveFormat format;  // The output keeps the (resampled) input's sample rate
+  wave_format_init(&format, rate, 2u, 16u, WAVE_FORMAT_PCM);
 
-  int16_t * temp = calloc((size_t) (numsamples * 2), sizeof(int16_t)); // Allocate memory and intitialize temporary array to zero
+  if (same_file(wavefilein, argv[2])) {  // The output would truncate the input before it is read
+    fatal_error("Output file is the input file");
+  }
+  FILE * wavefileout = fopen(argv[2], "w+b");  // Open wave file and do the proper checks, readable so it can be mapped
+  if (wavefileout == NULL) {
+    fatal_error("Cannot open output file");
+  }
 
-  for (unsigned i = delay * 2; i < numsamples * 2; ++i) { // Adjust temp values for the echo delay
+  ReverbEffect reverb;
+  DelayEffect *echo = NULL;
+  PipeEffect effect;  // Effect run on each block and its state
+  void *state;
+  unsigned block;
+  if (irname) {  // Reverb instead of echoes
+    stats_start(&mark);
+    reverb_init(&reverb, irname, echoamp, dither, rate);
+    stats_stop(&mark, STAGE_PARSE);
+    effect = reverb_effect;
+    state = &reverb;
+    block = reverb.conv.block;
+  }
+  else {
+    echo = malloc(sizeof(DelayEffect));
+    if (echo == NULL) {
+      fatal_error("Cannot allocate delay effect");
+    }
+    delay_init(&echo->line, taps, numtaps, feedback);
+    echo->dither = dither;
+    effect = delay_effect;
+    state = echo;
+    block = MIX_BLOCK;
+  }
 
-    temp[i] += (echoamp / 1.0) * buf[i - delay * 2];
-   
+  // Work on the sample data in place when both files can be mapped, otherwise stream it
+  WaveMap inmap, outmap;
+  unsigned expected = numsamples;  // Samples the input header promises
+  int mapped = !threaded && resample == NULL && wavemap_input(wavefilein, numsamples, &inmap);
+  if (mapped) {
+    numsamples = inmap.num_samples;
   }
 
-  for (unsigned i = 0; i < numsamples * 2; ++i) {  // Assign buf values to the updated temp values
+  stats_start(&mark);
+  write_wave_format(wavefileout, &format, numsamples);
+  stats_stop(&mark, STAGE_HEADER);
 
-    buf[i] += temp[i];
-    
+  if (mapped && !wavemap_output(wavefileout, numsamples, &outmap)) {
+    wavemap_close(&inmap);
+    mapped = 0;
   }
 
-  FILE * wavefileout = fopen(argv[2], "wb");  // Open wave file and do the proper checks
-  if (wavefileout == NULL) {
-    free(temp);
-    free(buf);
-    fatal_error("Cannot open output file");
+  unsigned written;
+  if (mapped) {
+    written = pipeline_run_mapped(inmap.samples, outmap.samples, numsamples, block, effect, state);
+    wavemap_close(&outmap);
+    wavemap_close(&inmap);
+  }
+  else if (resample) {
+    written = pipeline_run_source(resample_read, resample, wavefileout, numsamples, block,
+                                  effect, state, threaded);
+    rs_free(&resample->rs);
+    free(resample);
+  }
+  else {
+    written = pipeline_run(wavefilein, wavefileout, numsamples, block, effect, state, threaded);
   }
 
-  // Write_wave_header(FILE *out, unsigned num_samples);
-  write_wave_header(wavefileout, numsamples);
+  if (irname) {
+    conv_free(&reverb.conv);
+    free(reverb.in);
+    free(reverb.bus);
+  }
+  else {
+    delay_free(&echo->line);
+    free(echo);
+  }
 
-  // Write_s16_buf(FILE *out, const int16_t buf[], unsigned n)                  
-  write_s16_buf(wavefileout, buf, (numsamples * 2));
+  if (written < expected) {  // Input was truncated
+    fprintf(stderr, "Warning: input truncated, read %u of %u samples\n", written, expected);
+  }
+  if (written < numsamples) {  // Streamed past the end of the input, fix the header to match what was written
+    if (fseek(wavefileout, 0L, SEEK_SET) == 0) {
+      write_wave_format(wavefileout, &format, written);
+    }
+    else {
+      fprintf(stderr, "Warning: output is not seekable, header still claims %u samples\n", numsamples);
+    }
+  }
 
-  // Free the memory and close the files
+  // Close the files
   fclose(wavefileout);
   fclose(wavefilein);
-  free(buf);
-  free(temp);
+  stats_report("render_echo");
   
   return 0;
 }
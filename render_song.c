@@ -1,155 +1,333 @@
 //Jack Tarantino - jtarant3
 //Weina Dai - wdai11
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "io.h"
 #include "wave.h"
+#include "song.h"
+#include "wavetable.h"
+#include "pool.h"
+#include "stats.h"
 #include <math.h>
+#include <time.h>
 
+#define BATCH_LINE 4096  // Longest line of a batch manifest
 
-/*                                                                             
- * This program renders a song
- * with the input text file that describes a song and 
- * write the song to the output .wav file
- * Returns: -1 for failed run, 0 for successful run.                           
+/* one song of a batch */
+typedef struct {
+  char *song;        /* path of the song file */
+  char *output;      /* path of the wave file to write */
+  double seconds;    /* wall time the job took */
+  const char *error; /* why the job failed, or NULL if it succeeded */
+} BatchJob;
+
+/* what every batch job shares */
+typedef struct {
+  BatchJob *jobs;
+  const WaveFormat *format;
+  unsigned polyphony;
+  int dither;
+  const char *cache_dir;
+} Batch;
+
+/*
+ * This function returns a monotonic time in seconds.
  */
-int main(int argc, char *argv[]) {
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-  if (argc < 3) {  // Check if the user enters correct number of command line arguements
-    fatal_error("Invalid number of inputs");
+/*
+ * This function renders the song file songpath to the wave file
+ * outpath in the given format. If error is NULL a failure ends the
+ * program, as everywhere else; otherwise the failure is stored in
+ * *error, whatever was set up is released, a partly written output is
+ * removed and -1 is returned, so one bad job of a batch does not stop
+ * the others. Returns 0 on success.
+ */
+static int render_file(const char *songpath, const char *outpath, const WaveFormat *format,
+                       unsigned threads, unsigned polyphony, int dither, const char *cache_dir,
+                       const char **error) {
+  FatalTrap trap;  // Loading and opening release what they hold before failing
+  if (error) {
+    fatal_trap_set(&trap);
+    if (setjmp(trap.env) != 0) {
+      *error = trap.message;
+      return -1;
+    }
   }
 
-  FILE * songinput = fopen(argv[1], "r"); // Open input textfile and do proper checks
-  if (songinput == NULL) {
-    fatal_error("Cannot open input file");
+  Song song;  // Parse the song file into a list of notes
+  StatsMark mark;
+  stats_start(&mark);
+  song_load(songpath, &song);
+  stats_stop(&mark, STAGE_PARSE);
+  if (polyphony) {
+    song.polyphony = polyphony;
   }
-   
-  unsigned numsamples; // Read the numer of samples from the songinput
-  if (fscanf(songinput, "%u ", &numsamples) != 1) {
-    fclose(songinput);
-    fatal_error("Cannot parse sample number");
-  } 
-
-  unsigned beat; // Read the number of beats from songinput
-  if (fscanf(songinput, "%u ", &beat) != 1) {
-    fclose(songinput);
-    fatal_error("Cannot parse beat length");
+  if (format->sample_rate != song.sample_rate) {
+    song_set_rate(&song, format->sample_rate);
   }
 
-  int16_t * buf = calloc((size_t) (numsamples * 2), sizeof(int16_t));  // Allocate memory and initialize buf array to zero
- 
-  char cur;  // Switch case value
-  int curvoice = 0; // Current voice
-  float curamp = 0.1; // Current amplitude
-  int i = 0; // Index
-
-  float b; // Beat
-  int n; // MIDI note number 
-  int length; // Partition of a sample
-  float freq; // Frequency
-  
-  while((cur = fgetc(songinput)) != EOF && cur != '\n') {  // While we have input
-
-    switch (cur) {  // Switch case to take in data from file and make proper sound/pause
-
-    case 'N':  // Note Case
-      if (fscanf(songinput, "%f", &b) != 1) {  // Check for valid beat input
-	free(buf);
-        fatal_error("Cannot parse beat");  
-      } 
-      if (fscanf(songinput,"%d", &n) != 1) {  // Check for valid note input
-	free(buf);
-        fatal_error("Cannot parse MIDI note number");
-      }
-      
-      length = (int)(b * beat);  // Make proper adjustments for length
-      freq = (float)(440 * pow(2, (double)((n - 69.0) / 12.0)));  // Adjust the frequency
-      render_voice_stereo(&buf[i], length, freq, curamp, curvoice);
+  FILE * waveoutput = fopen(outpath, "wb");  // Open wave file to write to and do the proper checks
+  if (waveoutput == NULL) {
+    song_free(&song);
+    fatal_error("Cannot open output file");
+  }
 
-      i += 2 * length;  // Update index value
+  if (error) {  // From here a failure also has to release the song and the output
+    fatal_trap_clear(&trap);
+    fatal_trap_set(&trap);
+    if (setjmp(trap.env) != 0) {  // Leave no partial output behind a full length header
+      struct stat info;
+      int regular = fstat(fileno(waveoutput), &info) == 0 && S_ISREG(info.st_mode);
+      song_free(&song);
+      fclose(waveoutput);
+      if (regular) {  // Not a device such as /dev/full
+        unlink(outpath);
+      }
+      *error = trap.message;
+      return -1;
+    }
+  }
 
-      break;
+  song_render(&song, waveoutput, format, threads, dither, cache_dir);  // Write the wave header and every block of the song
 
-    case 'C':  // Chord Case
-      if (fscanf(songinput, "%f", &b) != 1) {  // Check for valid beat input
-	free(buf);
-      	fatal_error("Cannot parse beat");
-      }
-      
-      int temp;
-      length = (int)(b * beat);  // Adjust the length
-      while (fscanf(songinput, "%d", &temp) == 1 && temp != 999) {  // Loop to adjust the frequency and call render_voice_stereo
-      
-        freq = (float)(440 * pow(2, (double)((temp - 69.0) / 12.0)));
-        render_voice_stereo(&buf[i], length, freq, curamp, curvoice);	
-              
-      }
+  // Free memory and close files
+  song_free(&song);
+  if (fclose(waveoutput) != 0) {
+    fatal_error("Cannot write output file");
+  }
+  if (error) {
+    fatal_trap_clear(&trap);
+  }
+  return 0;
+}
 
-      i	+= 2 * length;
+/*
+ * This function reads a batch manifest: one song file and output
+ * file pair per line, separated by white space. Blank lines and
+ * lines starting with # are skipped. Returns the number of jobs.
+ */
+static unsigned read_manifest(const char *path, BatchJob **jobs) {
+  FILE *manifest = fopen(path, "r");
+  if (manifest == NULL) {
+    fatal_error("Cannot open batch manifest");
+  }
 
-      break;
+  char line[BATCH_LINE], song[BATCH_LINE], output[BATCH_LINE];
+  unsigned num_jobs = 0, max_jobs = 0;
+  *jobs = NULL;
+  while (fgets(line, sizeof(line), manifest) != NULL) {  // One job per line
+    if (strchr(line, '\n') == NULL && !feof(manifest)) {
+      fatal_error("Batch manifest line too long");
+    }
+    int fields = sscanf(line, "%s %s", song, output);
+    if (fields <= 0 || song[0] == '#') {
+      continue;
+    }
+    if (fields != 2) {
+      fatal_error("Batch manifest line needs a song and an output file");
+    }
 
-    case 'P':  // Pause Case
-      if (fscanf(songinput, "%f", &b) != 1) {  // Check for valid input
-	free(buf);
-      	fatal_error("Cannot parse beat");
+    if (num_jobs == max_jobs) {  // Grow the job list
+      max_jobs = max_jobs ? 2 * max_jobs : 64u;
+      BatchJob *bigger = realloc(*jobs, max_jobs * sizeof(BatchJob));
+      if (bigger == NULL) {
+        fatal_error("Cannot allocate batch jobs");
       }
-      
-      length = (int)(b * beat);  // Adjust the length for the pause
-      i += 2 * length;
-      
-      
-      break;
-
-    case 'V':  // Voice Case
-      if (fscanf(songinput, "%d", &curvoice) != 1) {  // Check for valid voice input
-	free(buf);
-	fatal_error("Cannot parse voice");
-      } 
-      
-      break;
-
-    case 'A':  // Amplitude Case
-      if (fscanf(songinput, "%f", &curamp) != 1) {  // Check for a valid amplitude input
-	free(buf);
-	fatal_error("Cannot parse amplitude");
-      } 
-      break;
-
-    }
-
-    if((cur = fgetc(songinput)) == '\n') {  // Check for new line
-      continue;
+      *jobs = bigger;
     }
-    else if(cur != EOF) {  // Check for end of file
-      free(buf);
-      fatal_error("Incorrect song format");
+    BatchJob *job = &(*jobs)[num_jobs++];
+    job->song = strdup(song);
+    job->output = strdup(output);
+    job->seconds = 0.0;
+    job->error = NULL;
+    if (job->song == NULL || job->output == NULL) {
+      fatal_error("Cannot allocate batch jobs");
     }
-    
+  }
+  if (ferror(manifest)) {
+    fatal_error("Error reading batch manifest");
+  }
+  fclose(manifest);
+  return num_jobs;
+}
+
+/*
+ * This function runs one job of a batch on a pool worker.
+ */
+static void batch_job(void *context, unsigned index, unsigned worker) {
+  Batch *batch = context;
+  BatchJob *job = &batch->jobs[index];
+  (void) worker;
+
+  double start = now_seconds();
+  render_file(job->song, job->output, batch->format, 1, batch->polyphony, batch->dither,
+              batch->cache_dir, &job->error);
+  job->seconds = now_seconds() - start;
+}
+
+/*
+ * This function renders every song of a batch manifest on a pool of
+ * threads and prints the time of each job and the overall rate. A job
+ * that fails is reported in its place and the others still run.
+ * Returns the number of jobs that failed.
+ */
+static unsigned render_batch(const char *path, const WaveFormat *format, unsigned threads,
+                             unsigned polyphony, int dither, const char *cache_dir) {
+  Batch batch;
+  unsigned num_jobs = read_manifest(path, &batch.jobs);
+  batch.format = format;
+  batch.polyphony = polyphony;
+  batch.dither = dither;
+  batch.cache_dir = cache_dir;
 
+  // The shared tables are built once, before any worker needs them
+  midi_to_freq(0);
+  wavetable_init();
+
+  double start = now_seconds();
+  pool_run(num_jobs, threads, batch_job, &batch);
+  double elapsed = now_seconds() - start;
+
+  unsigned failed = 0;
+  for (unsigned i = 0; i < num_jobs; i++) {  // Report in manifest order
+    BatchJob *job = &batch.jobs[i];
+    if (job->error) {
+      printf("%10s    %s -> %s: %s\n", "failed", job->song, job->output, job->error);
+      failed++;
+    }
+    else {
+      printf("%10.3f s  %s -> %s\n", job->seconds, job->song, job->output);
+    }
+    free(job->song);
+    free(job->output);
   }
-  if (ferror(songinput)) {
-    fatal_error("Error indicatior was set for the input file");
+  printf("%u songs in %.3f s, %.1f songs/s\n", num_jobs - failed, elapsed,
+         elapsed > 0.0 ? (num_jobs - failed) / elapsed : 0.0);
+  if (failed) {
+    fprintf(stderr, "Error: %u of %u songs failed\n", failed, num_jobs);
   }
-  
-  FILE * waveoutput = fopen(argv[2], "wb");  // Open wave file to write to and do the proper checks
-  if (waveoutput == NULL) {
-    free(buf);
-    fatal_error("Cannot open output file");
+  free(batch.jobs);
+  return failed;
+}
+
+
+/*                                                                             
+ * This program renders a song
+ * with the input text file that describes a song and 
+ * write the song to the output .wav file
+ * The song file may also be a Standard MIDI File (type 0 or 1), which
+ * is read straight into the same list of notes.
+ * The whole song file is parsed into a list of notes first, then
+ * the notes are mixed and written one block at a time, so memory
+ * use does not grow with the length of the rendered audio.
+ * Usage: render_song [-j threads] [-p voices] [-d] [--stats] [-c cachedir]
+ *          [-F rate:channels:depth] song.txt output.wav
+ *        render_song [-j threads] [-p voices] [-d] [--stats] [-c cachedir]
+ *          [-F rate:channels:depth] -b manifest.txt
+ * With -j the song is split into segments rendered on that many
+ * threads; the output is identical to a single threaded render.
+ * With -p at most that many notes sound at once (default 64); a note
+ * that starts when every voice is busy steals the oldest one, which
+ * fades out quickly.
+ * With -d the mix is converted to 16 bits with TPDF dither.
+ * With -F the song is rendered in the given format, for example
+ * -F 22050:1:16 for a quick mono preview or -F 96000:2:24 for a
+ * master; the default is 44100:2:16. Song times, which are given in
+ * 44.1 KHz samples, are scaled to the output rate.
+ * With -c each rendered segment of about 1.5 seconds is kept in the
+ * cache directory, keyed by a hash of the notes that sound in it, and
+ * reused by later renders, so re-rendering an edited song only renders
+ * the segments the edit changed. The directory is never cleaned up;
+ * delete it to reclaim the space.
+ * With -b every song file and output file pair listed in the manifest
+ * (one pair per line) is rendered in one process: the shared tables
+ * are built once and the songs are shared out to -j threads by a work
+ * stealing pool, each song rendered on one thread. The time of each
+ * song and the number of songs per second are printed. A song that
+ * fails is reported in its place while the rest still render, and the
+ * run then fails.
+ * With --stats the wall and CPU time of each stage (parse, header,
+ * render, mix, write), the throughput and the peak memory use are
+ * printed to stderr at the end; --stats=json prints them as one line
+ * of JSON. Stage times are summed over threads.
+ * Returns: -1 for failed run, 0 for successful run.                           
+ */
+int main(int argc, char *argv[]) {
+
+  unsigned threads = 1;  // Number of render threads
+  unsigned polyphony = 0;  // Number of voice slots, 0 for the song's default
+  int dither = 0;  // Whether to dither the final conversion
+  WaveFormat format;  // Output format
+  wave_format_init(&format, SAMPLES_PER_SECOND, NUM_CHANNELS, BITS_PER_SAMPLE, WAVE_FORMAT_PCM);
+  const char *manifest = NULL;  // Batch manifest, if any
+  const char *cache_dir = NULL;  // Segment cache directory, if any
+  int arg = 1;  // Index of the first argument that is not an option
+  while (arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0') {  // Read the options
+    if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc) {
+      if (sscanf(argv[arg + 1], "%u", &threads) != 1 || threads < 1) {  // Check for a valid thread count
+        fatal_error("Invalid thread count");
+      }
+      arg += 2;
+    }
+    else if (strcmp(argv[arg], "-p") == 0 && arg + 1 < argc) {
+      if (sscanf(argv[arg + 1], "%u", &polyphony) != 1 || polyphony < 1) {  // Check for a valid voice count
+        fatal_error("Invalid voice count");
+      }
+      arg += 2;
+    }
+    else if (strcmp(argv[arg], "-d") == 0) {
+      dither = 1;
+      arg++;
+    }
+    else if (stats_option(argv[arg])) {
+      arg++;
+    }
+    else if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc) {
+      cache_dir = argv[arg + 1];
+      arg += 2;
+    }
+    else if (strcmp(argv[arg], "-b") == 0 && arg + 1 < argc) {
+      manifest = argv[arg + 1];
+      arg += 2;
+    }
+    else if (strcmp(argv[arg], "-F") == 0 && arg + 1 < argc) {
+      if (!wave_format_parse(argv[arg + 1], &format)) {  // Check for a supported output format
+        fatal_error("Invalid output format");
+      }
+      arg += 2;
+    }
+    else {
+      fatal_error("Invalid option");
+    }
   }
 
-  // Call write_wave_header(FILE *out, unsigned num_samples);
-  write_wave_header(waveoutput, numsamples);
+  if (manifest) {  // Render every song of the manifest
+    if (argc != arg) {
+      fatal_error("Invalid number of inputs");
+    }
+    unsigned failed = render_batch(manifest, &format, threads, polyphony, dither, cache_dir);
+    stats_report("render_song");
+    return failed ? -1 : 0;
+  }
 
-  // Call write_s16_buf(FILE *out, const int16_t buf[], unsigned n)
-  write_s16_buf(waveoutput, buf, (2 * numsamples));
+  if (argc - arg < 2) {  // Check if the user enters correct number of command line arguements
+    fatal_error("Invalid number of inputs");
+  }
 
-  // Free memory and close files
-  fclose(songinput);
-  fclose(waveoutput);
-  free(buf);
+  render_file(argv[arg], argv[arg + 1], &format, threads, polyphony, dither, cache_dir, NULL);
+  stats_report("render_song");
   
   return 0;
 
@@ -4,8 +4,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include "io.h"
 #include "wave.h"
+#include "mix.h"
+#include "stats.h"
 #include <math.h>
 
 
@@ -13,16 +16,47 @@
  * This program renders a continuous tone with inputed 
  * voice, frequency, amplitude, and duration from the command
  * line and then writes it to a WAVE file.
+ * The tone is mixed into a float bus and converted to the output
+ * format one block at a time as it is written.
+ * Usage: render_tone [-d] [--stats] [-F rate:channels:depth] voice frequency
+ *          amplitude numsamples output.wav
+ * With -d the conversion to 16 bits uses TPDF dither.
+ * With -F the output has the given sample rate, 1 or 2 channels and a
+ * depth of 16, 24 or f32 (float), for example -F 22050:1:16; the
+ * default is 44100:2:16. numsamples counts frames at that rate.
+ * With --stats the wall and CPU time of each stage, the throughput and
+ * the peak memory use are printed to stderr at the end; --stats=json
+ * prints them as one line of JSON.
  * Returns: -1 for failed run, 0 for successful run.
  */
 int main(int argc, char *argv[]) {
-  if (argc < 6) {  // Check to see if proper number of inputs were entered
-    fatal_error("Invalid number of inputs");
+  int dither = 0;  // Whether to dither the final conversion
+  WaveFormat format;  // Output format
+  wave_format_init(&format, SAMPLES_PER_SECOND, NUM_CHANNELS, BITS_PER_SAMPLE, WAVE_FORMAT_PCM);
+  int arg = 1;  // Index of the first argument that is not an option
+  while (arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0') {  // Read the options
+    if (strcmp(argv[arg], "-d") == 0) {
+      dither = 1;
+      arg++;
+    }
+    else if (stats_option(argv[arg])) {
+      arg++;
+    }
+    else if (strcmp(argv[arg], "-F") == 0 && arg + 1 < argc) {
+      if (!wave_format_parse(argv[arg + 1], &format)) {  // Check for a supported output format
+        fatal_error("Invalid output format");
+      }
+      arg += 2;
+    }
+    else {
+      fatal_error("Invalid option");
+    }
   }
+  argv += arg - 1;  // Let the positional arguments start at argv[1]
+  argc -= arg - 1;
 
-  FILE *wave = fopen(argv[5], "wb");  // Read in the wave file name and check to see if it was opened properly
-  if (wave == NULL) {
-    fatal_error("File could not be opened");
+  if (argc < 6) {  // Check to see if proper number of inputs were entered
+    fatal_error("Invalid number of inputs");
   }
 
   unsigned voice;
@@ -44,10 +78,8 @@ int main(int argc, char *argv[]) {
   if (sscanf(argv[4], "%u", &numsamples) != 1) {  // Check if unsigned was entered for numsamples value
     fatal_error("Invalid sample number");
   }
-  
-  int16_t *buf = calloc((2 * numsamples), sizeof(int16_t));  // Allocate an array of (numsamples * 2) int16_t and initialize to zero
 
-  if ((voice != 0) && (voice != 1) && (voice != 2)) {  // Check if proper voice value was inputed
+  if (voice >= NUM_VOICES) {  // Check if proper voice value was inputed
     fatal_error("Invalid value for voice input");
   }
 
@@ -55,14 +87,43 @@ int main(int argc, char *argv[]) {
     fatal_error( "Invalid value for amplitude input");
   }
 
-  render_voice_stereo(buf, numsamples, frequency, amplitude, voice);  // Render with the input values
+  FILE *wave = fopen(argv[5], "wb");  // Read in the wave file name and check to see if it was opened properly
+  if (wave == NULL) {
+    fatal_error("File could not be opened");
+  }
 
-  write_wave_header(wave, numsamples);  // Write the wave header
+  StatsMark mark;
+  stats_start(&mark);
+  write_wave_format(wave, &format, numsamples);  // Write the wave header
+  stats_stop(&mark, STAGE_HEADER);
 
-  write_s16_buf(wave, buf, (2 * numsamples));  // Write the values to a wave file
+  Oscillator osc;  // Render with the input values
+  osc_init_rate(&osc, frequency, amplitude, voice, format.sample_rate);
+
+  float bus[WAVE_MAX_CHANNELS * MIX_BLOCK];
+  union {  // Encoded block, aligned for the 16 bit samples wave_encode stores in it
+    uint8_t bytes[WAVE_MAX_CHANNELS * MIX_BLOCK * 4];
+    int16_t s16[WAVE_MAX_CHANNELS * MIX_BLOCK * 2];
+    float f32[WAVE_MAX_CHANNELS * MIX_BLOCK];
+  } block;
+  for (unsigned done = 0; done < numsamples; ) {  // Render, convert and write one block at a time
+    unsigned count = numsamples - done < MIX_BLOCK ? numsamples - done : MIX_BLOCK;
+
+    stats_start(&mark);
+    memset(bus, 0, sizeof(bus));
+    osc_mix(&osc, bus, count, format.channels, 1.0f, 1.0f);
+    stats_lap(&mark, STAGE_RENDER);
+    wave_encode(&format, block.bytes, bus, format.channels * count, dither, done);
+    stats_lap(&mark, STAGE_MIX);
+    write_u8_buf(wave, block.bytes, count * format.block_align);  // Write the values to a wave file
+    stats_stop(&mark, STAGE_WRITE);
+    stats_add_output(count, (uint64_t) count * format.block_align);
+
+    done += count;
+  }
 
-  free(buf);  // Free memory
   fclose(wave);
+  stats_report("render_tone");
   
   return 0;
 
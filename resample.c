@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "io.h"
+#include "wave.h"
+#include "resample.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RS_X86 1
+#include <immintrin.h>
+#endif
+
+/* filter design of each quality preset */
+static const struct {
+  unsigned taps;   /* filter length in input frames when not downsampling */
+  double beta;     /* Kaiser window shape; larger is more stopband attenuation */
+  double rolloff;  /* cutoff as a fraction of the lower Nyquist frequency */
+} rs_presets[RS_NUM_QUALITIES] = {
+  { 16u, 5.0, 0.85 },   /* RS_FAST */
+  { 32u, 7.5, 0.91 },   /* RS_MEDIUM */
+  { 64u, 10.0, 0.95 },  /* RS_BEST */
+};
+
+/*
+ * Return the zeroth order modified Bessel function of x, for the
+ * Kaiser window.
+ */
+static double bessel_i0(double x) {
+  double sum = 1.0, term = 1.0;
+  for (int k = 1; k < 50; k++) {
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+    if (term < sum * 1e-12) {
+      break;
+    }
+  }
+  return sum;
+}
+
+/*
+ * Return the greatest common divisor of a and b.
+ */
+static unsigned gcd(unsigned a, unsigned b) {
+  while (b != 0u) {
+    unsigned t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+/*
+ * Add up n products of c[] with l[] and with r[], one sum per channel.
+ * This is the portable path.
+ */
+static void rs_dot_scalar(const float c[], const float l[], const float r[],
+                          unsigned n, float *out_l, float *out_r) {
+  float sum_l = 0.0f, sum_r = 0.0f;
+  for (unsigned j = 0; j < n; j++) {
+    sum_l += c[j] * l[j];
+    sum_r += c[j] * r[j];
+  }
+  *out_l = sum_l;
+  *out_r = sum_r;
+}
+
+#ifdef RS_X86
+/*
+ * SSE version of rs_dot_scalar, four products per instruction.
+ * n must be a multiple of 4.
+ */
+__attribute__((target("sse")))
+static void rs_dot_sse(const float c[], const float l[], const float r[],
+                       unsigned n, float *out_l, float *out_r) {
+  __m128 sum_l = _mm_setzero_ps(), sum_r = _mm_setzero_ps();
+  for (unsigned j = 0; j < n; j += 4u) {
+    __m128 k = _mm_loadu_ps(&c[j]);
+    sum_l = _mm_add_ps(sum_l, _mm_mul_ps(k, _mm_loadu_ps(&l[j])));
+    sum_r = _mm_add_ps(sum_r, _mm_mul_ps(k, _mm_loadu_ps(&r[j])));
+  }
+  float parts_l[4], parts_r[4];
+  _mm_storeu_ps(parts_l, sum_l);
+  _mm_storeu_ps(parts_r, sum_r);
+  *out_l = (parts_l[0] + parts_l[1]) + (parts_l[2] + parts_l[3]);
+  *out_r = (parts_r[0] + parts_r[1]) + (parts_r[2] + parts_r[3]);
+}
+
+/*
+ * AVX version of rs_dot_scalar, eight products per instruction.
+ * n must be a multiple of 8.
+ */
+__attribute__((target("avx")))
+static void rs_dot_avx(const float c[], const float l[], const float r[],
+                       unsigned n, float *out_l, float *out_r) {
+  __m256 sum_l = _mm256_setzero_ps(), sum_r = _mm256_setzero_ps();
+  for (unsigned j = 0; j < n; j += 8u) {
+    __m256 k = _mm256_loadu_ps(&c[j]);
+    sum_l = _mm256_add_ps(sum_l, _mm256_mul_ps(k, _mm256_loadu_ps(&l[j])));
+    sum_r = _mm256_add_ps(sum_r, _mm256_mul_ps(k, _mm256_loadu_ps(&r[j])));
+  }
+  __m128 half_l = _mm_add_ps(_mm256_castps256_ps128(sum_l), _mm256_extractf128_ps(sum_l, 1));
+  __m128 half_r = _mm_add_ps(_mm256_castps256_ps128(sum_r), _mm256_extractf128_ps(sum_r, 1));
+  _mm256_zeroupper();  // Avoid AVX to SSE transition stalls in the caller
+  float parts_l[4], parts_r[4];
+  _mm_storeu_ps(parts_l, half_l);
+  _mm_storeu_ps(parts_r, half_r);
+  *out_l = (parts_l[0] + parts_l[1]) + (parts_l[2] + parts_l[3]);
+  *out_r = (parts_r[0] + parts_r[1]) + (parts_r[2] + parts_r[3]);
+}
+#endif
+
+/*
+ * Return the name of the inner product path the running CPU uses.
+ */
+const char *rs_dot_path(void) {
+#ifdef RS_X86
+  if (__builtin_cpu_supports("avx")) {
+    return "avx";
+  }
+  if (__builtin_cpu_supports("sse")) {
+    return "sse";
+  }
+#endif
+  return "scalar";
+}
+
+/*
+ * Return the frames of silence rs_finish appends: one more than half
+ * the filter, for positions rounded up to the next frame.
+ */
+static unsigned rs_pad(const Resampler *rs) {
+  return rs->taps / 2u + 1u;
+}
+
+/*
+ * Set up a resampler from in_rate to out_rate. Any pair of rates
+ * works: the ratio is reduced to up / down and the filter gets one
+ * phase per output position between input frames, or RS_MAX_PHASES
+ * phases with the position rounded when up is larger than that.
+ * When downsampling the filter is stretched so it cuts off below the
+ * output's Nyquist frequency.
+ * Parameters:
+ *  rs: the resampler to initialize
+ *  in_rate: the input sample rate
+ *  out_rate: the output sample rate
+ *  quality: RS_FAST, RS_MEDIUM or RS_BEST
+ */
+void rs_init(Resampler *rs, uint32_t in_rate, uint32_t out_rate,
+             unsigned quality) {
+  if (in_rate == 0u || out_rate == 0u || quality >= RS_NUM_QUALITIES) {
+    fatal_error("Invalid resampler settings");
+  }
+
+  unsigned g = gcd(in_rate, out_rate);
+  rs->up = out_rate / g;
+  rs->down = in_rate / g;
+  rs->num_phases = rs->up < RS_MAX_PHASES ? rs->up : RS_MAX_PHASES;
+
+  double cutoff = rs_presets[quality].rolloff;  /* relative to the input Nyquist frequency */
+  if (rs->down > rs->up) {
+    cutoff *= (double) rs->up / rs->down;
+  }
+  unsigned taps = (unsigned) ceil(rs_presets[quality].taps * rs_presets[quality].rolloff / cutoff);
+  rs->taps = (taps + 7u) & ~7u;
+
+  rs->coeffs = malloc((size_t) rs->num_phases * rs->taps * sizeof(float));
+  rs->capacity = RS_CHUNK + rs->taps + 1u + rs_pad(rs);  /* room for the silence rs_finish adds */
+  rs->hist_l = calloc(rs->capacity, sizeof(float));
+  rs->hist_r = calloc(rs->capacity, sizeof(float));
+  if (rs->coeffs == NULL || rs->hist_l == NULL || rs->hist_r == NULL) {
+    fatal_error("Cannot allocate resampler");
+  }
+
+  /* row p holds the filter centred p / num_phases of a frame past tap taps / 2 - 1 */
+  double half = rs->taps / 2.0, beta = rs_presets[quality].beta;
+  double norm = bessel_i0(beta);
+  for (unsigned p = 0; p < rs->num_phases; p++) {
+    float *row = &rs->coeffs[(size_t) p * rs->taps];
+    double frac = (double) p / rs->num_phases, sum = 0.0;
+    for (unsigned j = 0; j < rs->taps; j++) {
+      double u = frac + half - 1.0 - j;  /* distance from the output position, in input frames */
+      double x = PI * cutoff * u;
+      double sinc = fabs(x) < 1e-9 ? 1.0 : sin(x) / x;
+      double w = u / half;
+      double window = fabs(w) >= 1.0 ? 0.0 : bessel_i0(beta * sqrt(1.0 - w * w)) / norm;
+      row[j] = (float) (cutoff * sinc * window);
+      sum += row[j];
+    }
+    for (unsigned j = 0; j < rs->taps; j++) {  // Unity gain at DC for every phase
+      row[j] = (float) (row[j] / sum);
+    }
+  }
+
+  rs->dot = rs_dot_scalar;
+#ifdef RS_X86
+  if (__builtin_cpu_supports("avx")) {
+    rs->dot = rs_dot_avx;
+  }
+  else if (__builtin_cpu_supports("sse")) {
+    rs->dot = rs_dot_sse;
+  }
+#endif
+
+  /* taps / 2 - 1 frames of silence come before the first input frame */
+  rs->filled = rs->taps / 2u - 1u;
+  rs->end = UINT32_MAX;
+  rs->index = 0u;
+  rs->phase = 0u;
+}
+
+/*
+ * Drop buffered frames no future output reads.
+ */
+static void rs_compact(Resampler *rs) {
+  unsigned drop = rs->index < rs->filled ? rs->index : rs->filled;
+  if (drop > 0u) {
+    memmove(rs->hist_l, &rs->hist_l[drop], (rs->filled - drop) * sizeof(float));
+    memmove(rs->hist_r, &rs->hist_r[drop], (rs->filled - drop) * sizeof(float));
+    rs->filled -= drop;
+    rs->index -= drop;
+    rs->end -= rs->end == UINT32_MAX ? 0u : drop;
+  }
+}
+
+/*
+ * Return how many input frames rs_push accepts now, holding back room
+ * for the silence rs_finish appends.
+ */
+unsigned rs_space(Resampler *rs) {
+  rs_compact(rs);
+  return rs->capacity - rs_pad(rs) - rs->filled;
+}
+
+/*
+ * Append interleaved stereo input frames. num_frames must not be more
+ * than rs_space returned.
+ */
+void rs_push(Resampler *rs, const int16_t in[], unsigned num_frames) {
+  if (rs->index > rs->filled) {  // Skip frames no output reads, when downsampling a lot
+    unsigned skip = rs->index - rs->filled < num_frames ? rs->index - rs->filled : num_frames;
+    in += 2 * skip;
+    num_frames -= skip;
+    rs->index -= skip;
+  }
+
+  float *l = &rs->hist_l[rs->filled], *r = &rs->hist_r[rs->filled];
+  for (unsigned i = 0; i < num_frames; i++) {
+    l[i] = in[2 * i];
+    r[i] = in[2 * i + 1];
+  }
+  rs->filled += num_frames;
+}
+
+/*
+ * Mark the end of the input, so the last outputs can be computed
+ * against silence. One frame more than half the filter is added, for
+ * positions rounded up to the next frame.
+ */
+void rs_finish(Resampler *rs) {
+  rs_compact(rs);
+  unsigned pad = rs_pad(rs);
+  rs->end = rs->filled - (rs->taps / 2u - 1u);
+  memset(&rs->hist_l[rs->filled], 0, pad * sizeof(float));
+  memset(&rs->hist_r[rs->filled], 0, pad * sizeof(float));
+  rs->filled += pad;
+}
+
+/*
+ * Compute as many output frames as the buffered input allows, up to
+ * max_frames, as interleaved stereo int16_t rounded to nearest.
+ * Returns the number of frames stored in out.
+ */
+unsigned rs_pull(Resampler *rs, int16_t out[], unsigned max_frames) {
+  unsigned n = 0;
+
+  while (n < max_frames) {
+    unsigned base = rs->index, row = rs->phase;
+    if (rs->num_phases != rs->up) {  // Round the position to the nearest phase
+      row = (unsigned) (((uint64_t) rs->phase * rs->num_phases + rs->up / 2u) / rs->up);
+      if (row == rs->num_phases) {  // which may be the next input frame
+        row = 0u;
+        base++;
+      }
+    }
+    if (base + rs->taps > rs->filled || rs->index >= rs->end) {  // Needs input that has not arrived yet, or is past the end
+      break;
+    }
+
+    float l, r;
+    rs->dot(&rs->coeffs[(size_t) row * rs->taps], &rs->hist_l[base],
+            &rs->hist_r[base], rs->taps, &l, &r);
+    l = floorf(l + 0.5f);
+    r = floorf(r + 0.5f);
+    out[2 * n] = (int16_t) (l > 32767.0f ? 32767.0f : (l < -32768.0f ? -32768.0f : l));
+    out[2 * n + 1] = (int16_t) (r > 32767.0f ? 32767.0f : (r < -32768.0f ? -32768.0f : r));
+    n++;
+
+    rs->phase += rs->down;  // Step to the next output position
+    rs->index += rs->phase / rs->up;
+    rs->phase %= rs->up;
+  }
+  return n;
+}
+
+/*
+ * Return the number of output frames in_frames input frames resample
+ * to: one for every output position before the end of the input.
+ */
+unsigned rs_output_frames(const Resampler *rs, unsigned in_frames) {
+  return (unsigned) (((uint64_t) in_frames * rs->up + rs->down - 1u) / rs->down);
+}
+
+/*
+ * Free the buffers of a resampler.
+ */
+void rs_free(Resampler *rs) {
+  free(rs->coeffs);
+  free(rs->hist_l);
+  free(rs->hist_r);
+  rs->coeffs = NULL;
+  rs->hist_l = NULL;
+  rs->hist_r = NULL;
+}
@@ -0,0 +1,42 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <stdint.h>
+
+/* quality presets, trading filter length for speed */
+#define RS_FAST    0
+#define RS_MEDIUM  1
+#define RS_BEST    2
+#define RS_NUM_QUALITIES 3
+
+#define RS_MAX_PHASES 2048u /* most filter phases; finer ratios round the phase */
+#define RS_CHUNK      4096u /* input frames buffered between outputs */
+
+/* streaming polyphase windowed-sinc resampler for stereo samples */
+typedef struct {
+  unsigned up, down;     /* output rate / input rate as up / down, in lowest terms */
+  unsigned taps;         /* coefficients per phase, a multiple of 8 */
+  unsigned num_phases;   /* rows of coeffs, up or RS_MAX_PHASES */
+  float *coeffs;         /* num_phases rows of taps coefficients */
+  float *hist_l;         /* buffered input, one array per channel */
+  float *hist_r;
+  unsigned capacity;     /* frames each history array holds */
+  unsigned filled;       /* frames buffered */
+  unsigned end;          /* index past the last input frame, UINT32_MAX until rs_finish */
+  unsigned index;        /* history frame of the next output's first tap */
+  unsigned phase;        /* next output's position past index + taps / 2 - 1, in 1 / up frames */
+  void (*dot)(const float c[], const float l[], const float r[], unsigned n,
+              float *out_l, float *out_r);
+} Resampler;
+
+void rs_init(Resampler *rs, uint32_t in_rate, uint32_t out_rate,
+  unsigned quality);
+unsigned rs_space(Resampler *rs);
+void rs_push(Resampler *rs, const int16_t in[], unsigned num_frames);
+void rs_finish(Resampler *rs);
+unsigned rs_pull(Resampler *rs, int16_t out[], unsigned max_frames);
+unsigned rs_output_frames(const Resampler *rs, unsigned in_frames);
+const char *rs_dot_path(void);
+void rs_free(Resampler *rs);
+
+#endif /* RESAMPLE_H */
@@ -0,0 +1,1033 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "io.h"
+#include "wave.h"
+#include "mix.h"
+#include "wavetable.h"
+#include "song.h"
+#include "midi.h"
+#include "songfile.h"
+#include "stats.h"
+
+#define SCAN_EOF   (-1)   /* returned by the scanner past the end of input */
+#define NUMBER_MAX 63u    /* longest number token the scanner accepts */
+#define CACHE_VERSION 1u  /* changes whenever cached segments would render differently */
+#define CACHE_PATH 4096u  /* longest path of a cached segment */
+#define CACHE_NAME 22u    /* "/", 16 hex digits, ".seg" and the terminator after the directory */
+
+/* cursor over the bytes of a song file */
+typedef struct {
+  const char *pos;
+  const char *end;
+} Scanner;
+
+/* a note that is sounding in the segment being rendered */
+typedef struct {
+  Oscillator osc;
+  unsigned start;  /* first sample of the note */
+  unsigned end;    /* one past the last sample of the note, where it is released */
+  unsigned fade;   /* where it starts fading out because its slot was stolen, or stop */
+  unsigned stop;   /* one past the last sample it sounds */
+  const SongEvent *event;  /* the note's envelope */
+  float gain_l;    /* left channel gain from the note's pan */
+  float gain_r;    /* right channel gain from the note's pan */
+} SongVoice;
+
+/* when a note stops sounding, decided by the voice allocator */
+typedef struct {
+  uint32_t fade;   /* where its steal fade starts, or stop if it was not stolen */
+  uint32_t stop;   /* one past the last sample it sounds, or its start if it is silent */
+} SongSpan;
+
+/* one stretch of a song rendered by one thread */
+typedef struct {
+  const Song *song;
+  const SongSpan *spans;  /* where each event stops */
+  const uint32_t *reach;  /* furthest stop of events 0..i */
+  unsigned from;          /* first sample of the segment */
+  unsigned to;            /* one past the last sample of the segment */
+  const WaveFormat *format;  /* output format */
+  uint8_t *out;           /* the rendered samples, encoded */
+  SongVoice *voices;      /* fixed pool of slots for the notes sounding in the current block */
+  unsigned num_voices;
+  unsigned max_voices;    /* number of slots, the song's polyphony */
+  int dither;             /* nonzero to convert with TPDF dither */
+  const char *cache_dir;  /* where rendered segments are cached, or NULL */
+} SongSegment;
+
+static float midi_table[128];
+static int midi_table_ready = 0;
+
+/*
+ * Return the frequency in Hz of a MIDI note number. Notes 0-127 come
+ * from a table computed on the first call.
+ */
+float midi_to_freq(int note) {
+  if (!midi_table_ready) {
+    for (int i = 0; i < 128; i++) {
+      midi_table[i] = (float)(440 * pow(2, (double)((i - 69.0) / 12.0)));
+    }
+    midi_table_ready = 1;
+  }
+
+  if (note >= 0 && note < 128) {
+    return midi_table[note];
+  }
+  return (float)(440 * pow(2, (double)((note - 69.0) / 12.0)));
+}
+
+/*
+ * Consume and return the next byte of input.
+ */
+static int scan_getc(Scanner *scan) {
+  return scan->pos < scan->end ? (unsigned char) *scan->pos++ : SCAN_EOF;
+}
+
+/*
+ * Skip spaces, tabs and newlines, the way scanf does before a number.
+ */
+static void scan_space(Scanner *scan) {
+  while (scan->pos < scan->end &&
+         (*scan->pos == ' ' || *scan->pos == '\t' || *scan->pos == '\n' ||
+          *scan->pos == '\r' || *scan->pos == '\v' || *scan->pos == '\f')) {
+    scan->pos++;
+  }
+}
+
+/*
+ * Read an optionally signed decimal integer. Returns 1 on success and
+ * 0 (consuming only whitespace) if there is no integer at the cursor.
+ * The value stops growing once it is past UINT32_MAX, so callers can
+ * reject numbers too big for any field instead of overflowing.
+ */
+static int scan_int(Scanner *scan, int64_t *val) {
+  scan_space(scan);
+  const char *p = scan->pos;
+  int negative = 0;
+
+  if (p < scan->end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+  if (p == scan->end || *p < '0' || *p > '9') {
+    return 0;
+  }
+
+  int64_t value = 0;
+  while (p < scan->end && *p >= '0' && *p <= '9') {
+    if (value <= (int64_t) UINT32_MAX) {
+      value = value * 10 + (*p - '0');
+    }
+    p++;
+  }
+
+  scan->pos = p;
+  *val = negative ? -value : value;
+  return 1;
+}
+
+/*
+ * Read a floating point number. The characters of the token are
+ * collected here and converted with strtof, so values round exactly
+ * the way fscanf's %f would. Returns 1 on success and 0 if there is
+ * no number at the cursor.
+ */
+static int scan_float(Scanner *scan, float *val) {
+  char token[NUMBER_MAX + 1];
+  unsigned len = 0;
+  char *stop;
+
+  scan_space(scan);
+  while (scan->pos + len < scan->end && len < NUMBER_MAX) {
+    char c = scan->pos[len];
+    if ((c >= '0' && c <= '9') || c == '.' || c == '-' || c == '+' ||
+        c == 'e' || c == 'E') {
+      token[len++] = c;
+    }
+    else {
+      break;
+    }
+  }
+  token[len] = '\0';
+
+  *val = strtof(token, &stop);
+  if (stop == token) {
+    return 0;
+  }
+  scan->pos += stop - token;
+  return 1;
+}
+
+/*
+ * Add a note to the end of a song's event list. Calls fatal_error,
+ * releasing the song, if it cannot grow.
+ * Parameters:
+ *  song: the song being built
+ *  event: the note to add
+ */
+void song_append(Song *song, const SongEvent *event) {
+  if (song->num_events == song->max_events) {  // Grow the event list
+    unsigned max_events = song->max_events ? 2 * song->max_events : 256u;
+    SongEvent *events = realloc(song->events, max_events * sizeof(SongEvent));
+    if (events == NULL) {
+      song_free(song);
+      fatal_error("Cannot allocate song events");
+    }
+    song->events = events;
+    song->max_events = max_events;
+  }
+  song->events[song->num_events++] = *event;
+}
+
+/*
+ * Release the parsed part of a song and report a parse error.
+ */
+static void parse_error(Song *song, const char *message) {
+  song_free(song);
+  fatal_error(message);
+}
+
+/*
+ * Return the length in samples of b beats, treating negative
+ * lengths as zero.
+ */
+static uint32_t beats_to_samples(float b, unsigned beat) {
+  int length = (int)(b * beat);
+  return length < 0 ? 0u : (uint32_t) length;
+}
+
+/*
+ * Sort the events of a song by start sample, keeping notes that start
+ * together in the order they were added, which is the order they are
+ * mixed in. A bottom up merge sort, since qsort is not stable.
+ * Parameters:
+ *  song: the song whose events are sorted
+ */
+void song_sort(Song *song) {
+  unsigned n = song->num_events;
+  SongEvent *from = song->events;
+  SongEvent *to = malloc((n ? n : 1u) * sizeof(SongEvent));
+  if (to == NULL) {
+    parse_error(song, "Cannot allocate song events");
+  }
+
+  for (unsigned width = 1; width < n; width *= 2u) {  // Merge runs of width into runs of twice that
+    for (unsigned lo = 0; lo < n; lo += 2u * width) {
+      unsigned mid = n - lo < width ? n : lo + width;
+      unsigned hi = n - mid < width ? n : mid + width;
+      unsigned a = lo, b = mid, k = lo;
+      while (a < mid && b < hi) {
+        to[k++] = from[b].start < from[a].start ? from[b++] : from[a++];
+      }
+      while (a < mid) {
+        to[k++] = from[a++];
+      }
+      while (b < hi) {
+        to[k++] = from[b++];
+      }
+    }
+    SongEvent *swap = from;
+    from = to;
+    to = swap;
+  }
+
+  if (from != song->events) {
+    song->max_events = n;
+  }
+  free(to);
+  song->events = from;
+}
+
+/*
+ * Parse the text of a song into song. Calls fatal_error if the text
+ * does not follow the song format.
+ */
+static void parse_song(const char *text, size_t size, Song *song) {
+  Scanner scan = { text, text + size };
+  int64_t value;
+  float b;
+  int cur;
+
+  SongEvent event;  // Current voice, amplitude, stereo position and envelope
+  event.start = 0u;
+  event.voice = 0u;
+  event.amplitude = 0.1f;
+  event.pan = 0.0f;
+  event.attack = 0u;  // No envelope: full level from the first sample to the last
+  event.decay = 0u;
+  event.sustain = 1.0f;
+  event.release = 0u;
+
+  song->events = NULL;
+  song->num_events = 0u;
+  song->max_events = 0u;
+  song->polyphony = SONG_POLYPHONY;
+  song->map = NULL;
+  song->map_size = 0u;
+  int sorted = 1;  // Whether no note starts before the one before it
+
+  if (!scan_int(&scan, &value) || value < 0 || value > (int64_t) UINT32_MAX) {  // Read the number of samples
+    fatal_error("Cannot parse sample number");
+  }
+  song->num_samples = (unsigned) value;
+  song->sample_rate = SAMPLES_PER_SECOND;
+  if (!scan_int(&scan, &value) || value < 0 || value > (int64_t) UINT32_MAX) {  // Read the length of a beat
+    fatal_error("Cannot parse beat length");
+  }
+  song->beat = (unsigned) value;
+  scan_space(&scan);
+
+  while ((cur = scan_getc(&scan)) != SCAN_EOF && cur != '\n') {  // One directive per line
+
+    switch (cur) {
+
+    case 'N':  // Note Case
+      if (!scan_float(&scan, &b)) {
+        parse_error(song, "Cannot parse beat");
+      }
+      if (!scan_int(&scan, &value) || value < INT32_MIN || value > INT32_MAX) {
+        parse_error(song, "Cannot parse MIDI note number");
+      }
+      event.length = beats_to_samples(b, song->beat);
+      event.note = (int32_t) value;
+      song_append(song, &event);
+      event.start += event.length;
+      break;
+
+    case 'C':  // Chord Case, notes until the 999 sentinel
+      if (!scan_float(&scan, &b)) {
+        parse_error(song, "Cannot parse beat");
+      }
+      event.length = beats_to_samples(b, song->beat);
+      while (scan_int(&scan, &value) && value != 999) {
+        if (value < INT32_MIN || value > INT32_MAX) {
+          parse_error(song, "Cannot parse MIDI note number");
+        }
+        event.note = (int32_t) value;
+        song_append(song, &event);
+      }
+      event.start += event.length;
+      break;
+
+    case 'P':  // Pause Case
+      if (!scan_float(&scan, &b)) {
+        parse_error(song, "Cannot parse beat");
+      }
+      event.start += beats_to_samples(b, song->beat);
+      break;
+
+    case '@':  // Start Time Case: later notes start at beat b, overlapping earlier ones
+      if (!scan_float(&scan, &b)) {
+        parse_error(song, "Cannot parse beat");
+      }
+      if (beats_to_samples(b, song->beat) < event.start) {
+        sorted = 0;
+      }
+      event.start = beats_to_samples(b, song->beat);
+      break;
+
+    case 'V':  // Voice Case
+      if (!scan_int(&scan, &value) || value < 0 || value > (int64_t) UINT32_MAX) {
+        parse_error(song, "Cannot parse voice");
+      }
+      event.voice = (uint32_t) value;
+      break;
+
+    case 'A':  // Amplitude Case
+      if (!scan_float(&scan, &event.amplitude)) {
+        parse_error(song, "Cannot parse amplitude");
+      }
+      break;
+
+    case 'S':  // Stereo Position Case
+      if (!scan_float(&scan, &event.pan)) {
+        parse_error(song, "Cannot parse stereo position");
+      }
+      break;
+
+    case 'E':  // Envelope Case: attack, decay (beats), sustain level, release (beats)
+      if (!scan_float(&scan, &b)) {
+        parse_error(song, "Cannot parse attack");
+      }
+      event.attack = beats_to_samples(b, song->beat);
+      if (!scan_float(&scan, &b)) {
+        parse_error(song, "Cannot parse decay");
+      }
+      event.decay = beats_to_samples(b, song->beat);
+      if (!scan_float(&scan, &event.sustain) || !(event.sustain >= 0.0f && event.sustain <= 1.0f)) {
+        parse_error(song, "Cannot parse sustain level");
+      }
+      if (!scan_float(&scan, &b)) {
+        parse_error(song, "Cannot parse release");
+      }
+      event.release = beats_to_samples(b, song->beat);
+      break;
+
+    }
+
+    if ((cur = scan_getc(&scan)) != '\n' && cur != SCAN_EOF) {  // Each directive ends its line
+      parse_error(song, "Incorrect song format");
+    }
+  }
+
+  if (!sorted) {
+    song_sort(song);
+  }
+}
+
+/*
+ * Parse a song file already in memory: a binary song or a Standard
+ * MIDI File if it starts with their magic, the text format otherwise.
+ * mapped is nonzero if text is a private, writable file mapping.
+ * Returns 1 if the song took over the mapping.
+ */
+static int parse_any(char *text, size_t size, int mapped, Song *song) {
+  if (size >= 4u && memcmp(text, SONGFILE_MAGIC, 4u) == 0) {
+    return songfile_read_binary(text, size, mapped, song);
+  }
+  if (size >= 4u && memcmp(text, "MThd", 4u) == 0) {
+    midi_parse((const uint8_t *) text, size, song);
+  }
+  else {
+    parse_song(text, size, song);
+  }
+  return 0;
+}
+
+/*
+ * Read and parse a song file, in the text format, as a binary song or
+ * as a Standard MIDI File, into a flat list of note events in order of
+ * start sample. The file is memory mapped when possible and read into
+ * memory otherwise (for example when it is a pipe); the events of a
+ * mapped binary song are used in place, without parsing.
+ * Calls fatal_error if the file can't be read or does not follow the
+ * song format.
+ * Parameters:
+ *  path: the name of the song file
+ *  song: where the parsed song is stored; release it with song_free
+ */
+void song_load(const char *path, Song *song) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fatal_error("Cannot open input file");
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+    void *text = mmap(NULL, (size_t) info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (text != MAP_FAILED) {
+      close(fd);
+      FatalTrap trap;  // Unmap the file if it does not parse
+      fatal_trap_set(&trap);
+      if (setjmp(trap.env) != 0) {
+        munmap(text, (size_t) info.st_size);
+        fatal_error(trap.message);
+      }
+      int owned = parse_any(text, (size_t) info.st_size, 1, song);
+      fatal_trap_clear(&trap);
+      if (!owned) {
+        munmap(text, (size_t) info.st_size);
+      }
+      return;
+    }
+  }
+
+  /* not a mappable file, read it all into memory instead */
+  FILE *in = fdopen(fd, "r");
+  if (in == NULL) {
+    close(fd);
+    fatal_error("Cannot open input file");
+  }
+
+  size_t size = 0, max_size = 4096u;
+  char *text = malloc(max_size);
+  size_t got;
+  while (text != NULL && (got = fread(text + size, 1, max_size - size, in)) > 0) {
+    size += got;
+    if (size == max_size) {
+      char *bigger = realloc(text, 2 * max_size);
+      if (bigger == NULL) {
+        free(text);
+      }
+      text = bigger;
+      max_size *= 2;
+    }
+  }
+  if (text == NULL) {
+    fclose(in);
+    fatal_error("Cannot allocate song text");
+  }
+  if (ferror(in)) {
+    free(text);
+    fclose(in);
+    fatal_error("Error indicatior was set for the input file");
+  }
+  fclose(in);
+
+  FatalTrap trap;  // Free the text if it does not parse
+  fatal_trap_set(&trap);
+  if (setjmp(trap.env) != 0) {
+    free(text);
+    fatal_error(trap.message);
+  }
+  parse_any(text, size, 0, song);
+  fatal_trap_clear(&trap);
+  free(text);
+}
+
+/*
+ * Free the event list of a song, or unmap the file it points into.
+ */
+void song_free(Song *song) {
+  if (song->map) {
+    munmap(song->map, song->map_size);
+    song->map = NULL;
+  }
+  else {
+    free(song->events);
+  }
+  song->events = NULL;
+  song->num_events = 0u;
+  song->max_events = 0u;
+}
+
+/*
+ * Add a note to a segment's list of sounding voices, starting its
+ * oscillator at sample from (the later of the note's start and the
+ * start of the segment). The caller makes sure a slot is free.
+ */
+static void segment_start_voice(SongSegment *seg, const SongEvent *event,
+                                const SongSpan *span, unsigned from) {
+  SongVoice *voice = &seg->voices[seg->num_voices++];
+  osc_init_rate(&voice->osc, midi_to_freq(event->note), event->amplitude, event->voice,
+                seg->song->sample_rate);
+  osc_seek(&voice->osc, from - event->start);
+  voice->start = event->start;
+  voice->end = event->start + event->length;
+  voice->fade = span->fade;
+  voice->stop = span->stop;
+  voice->event = event;
+  pan_gains(event->pan, &voice->gain_l, &voice->gain_r);
+}
+
+/*
+ * Return the level of a note's envelope offset samples after it
+ * starts, before it is released: a linear rise from 0.0 to 1.0 over
+ * the attack, a linear fall to the sustain level over the decay, and
+ * the sustain level after that.
+ */
+static float envelope_level(const SongEvent *event, uint32_t offset) {
+  if (offset < event->attack) {
+    return (float) offset * (1.0f / (float) event->attack);
+  }
+  offset -= event->attack;
+  if (offset < event->decay) {
+    return 1.0f - (float) offset * ((1.0f - event->sustain) / (float) event->decay);
+  }
+  return event->sustain;
+}
+
+/*
+ * Compute the envelope gains of num_samples samples of a note, the
+ * first offset samples after it starts. Once the note ends the level
+ * it had reached falls linearly to 0.0 over the release. Each gain
+ * depends only on its own offset, so a note renders the same however
+ * the song is split into blocks and segments; each stage is filled by
+ * its own loop so the common case has no branches.
+ */
+static void envelope_fill(const SongEvent *event, uint32_t offset, unsigned num_samples,
+                          float env[]) {
+  uint32_t stages[3];  // Where the attack, decay and held part of the note end
+  stages[0] = event->attack < event->length ? event->attack : event->length;
+  stages[1] = event->attack + event->decay < event->length ? event->attack + event->decay : event->length;
+  stages[2] = event->length;
+  float attack_step = event->attack ? 1.0f / (float) event->attack : 0.0f;
+  float decay_step = event->decay ? (1.0f - event->sustain) / (float) event->decay : 0.0f;
+  float released = envelope_level(event, event->length);
+  float release_step = event->release ? released / (float) event->release : 0.0f;
+  unsigned i = 0;
+
+  for (; i < num_samples && offset + i < stages[0]; i++) {
+    env[i] = (float) (offset + i) * attack_step;
+  }
+  for (; i < num_samples && offset + i < stages[1]; i++) {
+    env[i] = 1.0f - (float) (offset + i - event->attack) * decay_step;
+  }
+  for (; i < num_samples && offset + i < stages[2]; i++) {
+    env[i] = event->sustain;
+  }
+  for (; i < num_samples; i++) {
+    env[i] = released - (float) (offset + i - event->length) * release_step;
+  }
+}
+
+/*
+ * Mix samples [from, to) of every sounding voice of a segment into
+ * the bus of the block that starts at block_start, each scaled by its
+ * envelope as it is generated, and drop the voices that end by to.
+ * Voices are mixed in the order they started, so every sample sums
+ * its notes in event order however the block is split up.
+ */
+static void segment_mix(SongSegment *seg, float bus[], unsigned block_start,
+                        unsigned from, unsigned to) {
+  unsigned channels = seg->format->channels;
+  float env[SONG_BLOCK];
+  unsigned kept = 0u;
+
+  for (unsigned v = 0; v < seg->num_voices; v++) {
+    SongVoice *voice = &seg->voices[v];
+    const SongEvent *event = voice->event;
+    unsigned start = voice->start > from ? voice->start : from;
+    unsigned end = voice->stop < to ? voice->stop : to;
+    float *dst = &bus[channels * (start - block_start)];
+
+    if (end > start && start - voice->start >= event->attack + event->decay &&
+        end <= voice->end && end <= voice->fade) {  // Holding the sustain level
+      osc_mix(&voice->osc, dst, end - start, channels,
+              voice->gain_l * event->sustain, voice->gain_r * event->sustain);
+    }
+    else if (end > start) {
+      envelope_fill(event, start - voice->start, end - start, env);
+      for (unsigned t = start > voice->fade ? start : voice->fade; t < end; t++) {  // Fade out a stolen note
+        env[t - start] *= (float) (voice->stop - t) / (float) (voice->stop - voice->fade);
+      }
+      osc_mix_env(&voice->osc, dst, end - start, channels, voice->gain_l, voice->gain_r, env);
+    }
+    if (voice->stop > to) {  // Keep notes that go on past to
+      seg->voices[kept++] = *voice;
+    }
+  }
+  seg->num_voices = kept;
+}
+
+/*
+ * Add n bytes to a 64 bit FNV-1a hash.
+ */
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t n) {
+  const unsigned char *bytes = data;
+  for (size_t i = 0; i < n; i++) {
+    hash = (hash ^ bytes[i]) * 0x100000001B3u;
+  }
+  return hash;
+}
+
+/*
+ * Return the cache key of a segment: a hash of everything its
+ * rendered bytes depend on, which is the output format, the dither
+ * setting, where the segment lies and every note that sounds in it,
+ * with the span the voice allocator gave it. first is the first event
+ * still sounding at the start of the segment.
+ */
+static uint64_t segment_key(const SongSegment *seg, unsigned first) {
+  const Song *song = seg->song;
+  uint32_t header[10] = { CACHE_VERSION, seg->from, seg->to, song->sample_rate,
+                          seg->format->channels, seg->format->bits_per_sample,
+                          seg->format->format, (uint32_t) seg->dither, song->polyphony,
+                          (uint32_t) sizeof(SongEvent) };
+  uint64_t hash = hash_bytes(0xCBF29CE484222325u, header, sizeof(header));
+
+  for (unsigned e = first; e < song->num_events && song->events[e].start < seg->to; e++) {
+    const SongEvent *event = &song->events[e];
+    const SongSpan *span = &seg->spans[e];
+    if (span->stop <= seg->from || span->stop <= event->start) {  // Silent here
+      continue;
+    }
+    uint32_t fields[12];  // Each field on its own, so padding never reaches the hash
+    fields[0] = event->start;
+    fields[1] = event->length;
+    fields[2] = (uint32_t) event->note;
+    fields[3] = event->voice;
+    memcpy(&fields[4], &event->amplitude, sizeof(float));
+    memcpy(&fields[5], &event->pan, sizeof(float));
+    fields[6] = event->attack;
+    fields[7] = event->decay;
+    memcpy(&fields[8], &event->sustain, sizeof(float));
+    fields[9] = event->release;
+    fields[10] = span->fade;
+    fields[11] = span->stop;
+    hash = hash_bytes(hash, fields, sizeof(fields));
+  }
+  return hash;
+}
+
+/*
+ * Write the path of the cached segment with the given key to path.
+ * song_render has checked that the directory name leaves room for it.
+ */
+static void cache_path(char path[], const char *dir, uint64_t key) {
+  snprintf(path, CACHE_PATH, "%s/%016llx.seg", dir, (unsigned long long) key);
+}
+
+/*
+ * Fill the output of a segment from the cache. Returns 1 on a hit and
+ * 0 if the key is not cached (or its file is damaged).
+ */
+static int cache_load(SongSegment *seg, uint64_t key) {
+  char path[CACHE_PATH];
+  size_t size = (size_t) (seg->to - seg->from) * seg->format->block_align;
+  cache_path(path, seg->cache_dir, key);
+
+  FILE *in = fopen(path, "rb");
+  if (in == NULL) {
+    return 0;
+  }
+  int hit = fread(seg->out, 1, size, in) == size && fgetc(in) == EOF;
+  fclose(in);
+  return hit;
+}
+
+/*
+ * Store the output of a segment in the cache. The bytes go to a
+ * temporary file that is then renamed, so a concurrent render never
+ * sees a partial entry. Storing is best effort: on any error the entry
+ * is left out.
+ */
+static void cache_store(const SongSegment *seg, uint64_t key) {
+  char path[CACHE_PATH], temp[CACHE_PATH];
+  size_t size = (size_t) (seg->to - seg->from) * seg->format->block_align;
+  cache_path(path, seg->cache_dir, key);
+  if (snprintf(temp, CACHE_PATH, "%s/.tmp.XXXXXX", seg->cache_dir) >= (int) CACHE_PATH) {
+    return;
+  }
+
+  int fd = mkstemp(temp);
+  if (fd < 0) {
+    return;
+  }
+  FILE *out = fdopen(fd, "wb");
+  if (out == NULL) {
+    close(fd);
+    unlink(temp);
+    return;
+  }
+  int ok = fwrite(seg->out, 1, size, out) == size;
+  ok = fclose(out) == 0 && ok;
+  if (!ok || rename(temp, path) != 0) {
+    unlink(temp);
+  }
+}
+
+/*
+ * Render samples [from, to) of a song into the segment's output.
+ * Voices are mixed one block at a time into a float bus and each block
+ * is converted to the output format once, so the result does not
+ * depend on where the song was split into segments. When every slot is
+ * in use as a note starts, the block is mixed up to that note first,
+ * which frees the slots of the notes that have ended; the allocator
+ * has made sure that no more notes than slots sound at any sample.
+ * With a cache directory, a segment whose key is cached is read back
+ * instead of rendered, and a rendered one is stored.
+ */
+static void render_segment(SongSegment *seg) {
+  const Song *song = seg->song;
+  unsigned channels = seg->format->channels;
+  unsigned first = 0u, last = song->num_events;
+  float bus[WAVE_MAX_CHANNELS * SONG_BLOCK];
+
+  while (first < last) {  // Find the first note still sounding at from
+    unsigned mid = first + (last - first) / 2u;
+    if (seg->reach[mid] > seg->from) {
+      last = mid;
+    }
+    else {
+      first = mid + 1u;
+    }
+  }
+
+  uint64_t key = 0u;
+  if (seg->cache_dir) {
+    StatsMark mark;
+    stats_start(&mark);
+    key = segment_key(seg, first);
+    int hit = cache_load(seg, key);
+    stats_stop(&mark, STAGE_READ);
+    if (hit) {
+      return;
+    }
+  }
+
+  seg->num_voices = 0u;
+  for (unsigned block_start = seg->from; block_start < seg->to; block_start += SONG_BLOCK) {
+    unsigned block_end = block_start + SONG_BLOCK < seg->to ? block_start + SONG_BLOCK : seg->to;
+    unsigned mixed = block_start;  // Every voice is mixed up to here
+
+    StatsMark mark;
+    stats_start(&mark);
+    memset(bus, 0, channels * (block_end - block_start) * sizeof(float));
+    while (first < song->num_events && song->events[first].start < block_end) {  // Start notes that begin in this block
+      const SongEvent *event = &song->events[first];
+      const SongSpan *span = &seg->spans[first++];
+      if (span->stop <= block_start || span->stop <= event->start) {  // Silent or already over
+        continue;
+      }
+      unsigned from = event->start > block_start ? event->start : block_start;
+      if (seg->num_voices == seg->max_voices) {
+        segment_mix(seg, bus, block_start, mixed, from);
+        mixed = from;
+      }
+      segment_start_voice(seg, event, span, from);
+    }
+    segment_mix(seg, bus, block_start, mixed, block_end);
+    stats_lap(&mark, STAGE_RENDER);
+
+    // One conversion per block, dither seeded by position so threads agree
+    wave_encode(seg->format, &seg->out[(size_t) (block_start - seg->from) * seg->format->block_align],
+                bus, channels * (block_end - block_start), seg->dither, block_start);
+    stats_stop(&mark, STAGE_MIX);
+  }
+
+  if (seg->cache_dir) {
+    StatsMark mark;
+    stats_start(&mark);
+    cache_store(seg, key);
+    stats_stop(&mark, STAGE_WRITE);
+  }
+}
+
+/*
+ * Thread entry point for render_segment.
+ */
+static void *segment_thread(void *arg) {
+  render_segment(arg);
+  return NULL;
+}
+
+/*
+ * Change the sample rate a song is rendered at. Every note keeps its
+ * place in time; start and end samples and envelope times are rounded
+ * to the nearest sample at the new rate.
+ * Parameters:
+ *  song: the song to convert
+ *  sample_rate: the new sample rate in samples per second
+ */
+void song_set_rate(Song *song, uint32_t sample_rate) {
+  uint64_t from = song->sample_rate, to = sample_rate;
+
+  for (unsigned e = 0; e < song->num_events; e++) {
+    SongEvent *event = &song->events[e];
+    uint64_t start = ((uint64_t) event->start * to + from / 2u) / from;
+    uint64_t end = (((uint64_t) event->start + event->length) * to + from / 2u) / from;
+    event->start = (uint32_t) start;
+    event->length = (uint32_t) (end - start);
+    event->attack = (uint32_t) (((uint64_t) event->attack * to + from / 2u) / from);
+    event->decay = (uint32_t) (((uint64_t) event->decay * to + from / 2u) / from);
+    event->release = (uint32_t) (((uint64_t) event->release * to + from / 2u) / from);
+  }
+  song->num_samples = (unsigned) (((uint64_t) song->num_samples * to + from / 2u) / from);
+  song->beat = (unsigned) (((uint64_t) song->beat * to + from / 2u) / from);
+  song->sample_rate = sample_rate;
+}
+
+/*
+ * Decide when every note of a song stops sounding by playing it
+ * through a pool of song->polyphony voice slots. A note takes a free
+ * slot when it starts; when none is free it steals one, preferring
+ * the oldest note that is already in its release, then the oldest
+ * note, and the stolen note fades out over the SONG_STEAL_FADE samples
+ * before the new one starts. Decided once for the whole song, this
+ * makes the render the same however it is split into segments.
+ * Parameters:
+ *  song: the song, with events in order of start
+ *  spans: where the fade and stop of each event are stored
+ *  slots: song->polyphony entries of scratch space
+ */
+static void allocate_voices(const Song *song, SongSpan spans[], unsigned slots[]) {
+  unsigned used = 0u;
+
+  for (unsigned e = 0; e < song->num_events; e++) {
+    const SongEvent *event = &song->events[e];
+    uint32_t stop = event->start + event->length + event->release;
+    stop = stop > song->num_samples ? song->num_samples : stop;
+    spans[e].fade = spans[e].stop = stop;
+    if (event->voice >= NUM_VOICES || stop <= event->start) {  // Never sounds, needs no slot
+      spans[e].fade = spans[e].stop = event->start;
+      continue;
+    }
+
+    unsigned slot = used;
+    for (unsigned k = 0; k < used && slot == used; k++) {  // Look for a slot whose note has stopped
+      if (spans[slots[k]].stop <= event->start) {
+        slot = k;
+      }
+    }
+    if (slot == used && used < song->polyphony) {
+      used++;
+    }
+    else if (slot == used) {  // Every slot is sounding: steal one
+      slot = 0u;
+      for (unsigned k = 1; k < used; k++) {
+        const SongEvent *best = &song->events[slots[slot]];
+        const SongEvent *other = &song->events[slots[k]];
+        int best_released = best->start + best->length <= event->start;
+        int other_released = other->start + other->length <= event->start;
+        if (other_released > best_released ||
+            (other_released == best_released && slots[k] < slots[slot])) {
+          slot = k;
+        }
+      }
+      SongSpan *victim = &spans[slots[slot]];
+      uint32_t victim_start = song->events[slots[slot]].start;
+      victim->stop = event->start;
+      victim->fade = event->start - victim_start > SONG_STEAL_FADE ? event->start - SONG_STEAL_FADE : victim_start;
+    }
+    slots[slot] = e;
+  }
+}
+
+/*
+ * Render a parsed song and write it, header first, to out.
+ * The song is rendered in rounds of num_threads segments of
+ * SONG_SEGMENT samples, one per worker thread, and each round is
+ * written before the next starts, so memory use does not grow with
+ * the length of the song. Every segment is rendered the same way
+ * whatever the thread count, so the output is identical for any
+ * num_threads. At most song->polyphony notes sound at once; the voice
+ * slots are allocated once here, never per note.
+ * Parameters:
+ *  song: the song to render
+ *  out: the output stream
+ *  format: the output format; its sample rate must be the song's
+ *  num_threads: the number of worker threads to use; 1 renders on the
+ *               calling thread
+ *  dither: nonzero to apply TPDF dither when the mix bus is converted to
+ *          16 bit samples
+ *  cache_dir: a directory where rendered segments are kept, keyed by a
+ *             hash of their notes, so a re-render of an edited song
+ *             only renders the segments the edit touched; created if
+ *             missing. NULL to render everything.
+ */
+void song_render(const Song *song, FILE *out, const WaveFormat *format,
+                 unsigned num_threads, int dither, const char *cache_dir) {
+  SongSegment segs[SONG_MAX_THREADS];
+  pthread_t threads[SONG_MAX_THREADS];
+
+  if (format->sample_rate != song->sample_rate) {
+    fatal_error("Song and output sample rates differ");
+  }
+  if (format->channels < 1u || format->channels > WAVE_MAX_CHANNELS) {
+    fatal_error("Songs render in mono or stereo only");
+  }
+  if (song->polyphony < 1u) {
+    fatal_error("Songs need at least one voice slot");
+  }
+  if (cache_dir && strlen(cache_dir) + CACHE_NAME > CACHE_PATH) {  // Checked here, not on a render thread
+    fatal_error("Cache directory name too long");
+  }
+  struct stat info;
+  if (cache_dir && mkdir(cache_dir, 0777) != 0 &&
+      (stat(cache_dir, &info) != 0 || !S_ISDIR(info.st_mode))) {
+    fatal_error("Cannot create cache directory");
+  }
+
+  if (num_threads < 1u) {
+    num_threads = 1u;
+  }
+  else if (num_threads > SONG_MAX_THREADS) {
+    num_threads = SONG_MAX_THREADS;
+  }
+
+  /* the shared tables must exist before any worker reads them */
+  midi_to_freq(0);
+  wavetable_init();
+
+  /* reach[i] is the furthest stop of events 0..i, for finding the notes sounding at a sample */
+  unsigned num_events = song->num_events ? song->num_events : 1u;
+  uint32_t *reach = malloc(num_events * sizeof(uint32_t));
+  SongSpan *spans = malloc(num_events * sizeof(SongSpan));
+  SongVoice *voices = malloc((size_t) num_threads * song->polyphony * sizeof(SongVoice));
+  size_t seg_bytes = (size_t) SONG_SEGMENT * format->block_align;
+  uint8_t *out_buf = malloc((size_t) num_threads * seg_bytes);
+  unsigned *slots = malloc(song->polyphony * sizeof(unsigned));
+  if (reach == NULL || spans == NULL || voices == NULL || out_buf == NULL || slots == NULL) {
+    free(reach);
+    free(spans);
+    free(voices);
+    free(out_buf);
+    free(slots);
+    fatal_error("Cannot allocate song render buffers");
+  }
+  allocate_voices(song, spans, slots);
+  free(slots);
+
+  FatalTrap trap;  // Free the buffers if writing fails, then pass the error on
+  fatal_trap_set(&trap);
+  if (setjmp(trap.env) != 0) {
+    free(voices);
+    free(spans);
+    free(reach);
+    free(out_buf);
+    fatal_error(trap.message);
+  }
+
+  for (unsigned e = 0; e < song->num_events; e++) {
+    uint32_t stop = spans[e].stop;
+    reach[e] = (e > 0 && reach[e - 1] > stop) ? reach[e - 1] : stop;
+  }
+
+  for (unsigned t = 0; t < num_threads; t++) {
+    segs[t].song = song;
+    segs[t].spans = spans;
+    segs[t].reach = reach;
+    segs[t].format = format;
+    segs[t].out = &out_buf[t * seg_bytes];
+    segs[t].voices = &voices[(size_t) t * song->polyphony];
+    segs[t].max_voices = song->polyphony;
+    segs[t].dither = dither;
+    segs[t].cache_dir = cache_dir;
+  }
+
+  StatsMark mark;
+  stats_start(&mark);
+  write_wave_format(out, format, song->num_samples);
+  stats_stop(&mark, STAGE_HEADER);
+
+  for (unsigned round = 0; round < song->num_samples; ) {
+    unsigned used = 0;
+    for (; used < num_threads && round < song->num_samples; used++) {  // Hand one segment to each thread
+      segs[used].from = round;
+      segs[used].to = song->num_samples - round < SONG_SEGMENT ? song->num_samples : round + SONG_SEGMENT;
+      round = segs[used].to;
+    }
+
+    if (used == 1u) {
+      render_segment(&segs[0]);
+    }
+    else {
+      for (unsigned t = 0; t < used; t++) {
+        if (pthread_create(&threads[t], NULL, segment_thread, &segs[t]) != 0) {
+          while (t > 0) {  // The started threads still use the buffers
+            pthread_join(threads[--t], NULL);
+          }
+          fatal_error("Cannot start render thread");
+        }
+      }
+      for (unsigned t = 0; t < used; t++) {
+        pthread_join(threads[t], NULL);
+      }
+    }
+
+    stats_start(&mark);
+    for (unsigned t = 0; t < used; t++) {  // Write the segments in order
+      unsigned frames = segs[t].to - segs[t].from;
+      write_u8_buf(out, segs[t].out, frames * format->block_align);
+      stats_add_output(frames, (uint64_t) frames * format->block_align);
+    }
+    stats_stop(&mark, STAGE_WRITE);
+  }
+
+  fatal_trap_clear(&trap);
+  free(voices);
+  free(spans);
+  free(reach);
+  free(out_buf);
+}
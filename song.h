@@ -0,0 +1,52 @@
+#ifndef SONG_H
+#define SONG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "wave.h"
+
+#define SONG_BLOCK       4096u  /* stereo samples mixed per block */
+#define SONG_SEGMENT     65536u /* stereo samples rendered per thread per round */
+#define SONG_MAX_THREADS 256u   /* most worker threads song_render will start */
+#define SONG_POLYPHONY   64u    /* default number of voice slots */
+#define SONG_STEAL_FADE  64u    /* samples a note whose slot is stolen fades out over */
+
+/* one note of a parsed song */
+typedef struct {
+  uint32_t start;   /* first (stereo) sample of the note */
+  uint32_t length;  /* number of (stereo) samples the note lasts */
+  int32_t note;     /* MIDI note number */
+  uint32_t voice;   /* which waveform to generate */
+  float amplitude;  /* relative amplitude, where 1.0 is the maximum */
+  float pan;        /* stereo position from -1.0 (left) to 1.0 (right) */
+  uint32_t attack;  /* (stereo) samples the envelope takes to rise to 1.0 */
+  uint32_t decay;   /* (stereo) samples it then takes to fall to sustain */
+  float sustain;    /* envelope level held until the note ends */
+  uint32_t release; /* (stereo) samples it fades for after the note ends */
+} SongEvent;
+
+/* a parsed song: its header and its notes in order of start sample */
+typedef struct {
+  unsigned num_samples;  /* total (stereo) samples in the song */
+  unsigned beat;         /* (stereo) samples per beat */
+  uint32_t sample_rate;  /* samples per second the times above are in */
+  SongEvent *events;
+  unsigned num_events;
+  unsigned max_events;   /* allocated length of events */
+  unsigned polyphony;    /* voice slots: most notes that sound at once */
+  void *map;             /* file mapping events point into, or NULL if they were allocated */
+  size_t map_size;
+} Song;
+
+float midi_to_freq(int note);
+
+void song_load(const char *path, Song *song);
+void song_append(Song *song, const SongEvent *event);
+void song_sort(Song *song);
+void song_set_rate(Song *song, uint32_t sample_rate);
+void song_render(const Song *song, FILE *out, const WaveFormat *format,
+  unsigned num_threads, int dither, const char *cache_dir);
+void song_free(Song *song);
+
+#endif /* SONG_H */
@@ -0,0 +1,56 @@
+// Jack Tarantino - jtarant3
+// Weina Dai - wdai11
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "io.h"
+#include "wave.h"
+#include "song.h"
+#include "songfile.h"
+
+/*
+ * This program converts a song between the text format and the
+ * binary song format. The input may be a text song, a binary song or a
+ * Standard MIDI File; it is written as a binary song, or with -t in
+ * the text format. Binary songs load by mapping the file, with no
+ * parsing, so generative scores with millions of notes start rendering
+ * at once. Converting to text and back gives the same binary song.
+ * Usage: song_convert [-t] input output
+ * Returns: -1 for failed run, 0 for successful run.
+ */
+int main(int argc, char *argv[]) {
+  int text = 0;  // Whether to write the text format
+  int arg = 1;
+  if (arg < argc && strcmp(argv[arg], "-t") == 0) {
+    text = 1;
+    arg++;
+  }
+  if (argc - arg != 2) {  // Check if the user enters correct number of command line arguements
+    fatal_error("Usage: song_convert [-t] input output");
+  }
+
+  Song song;  // Parse the input into a list of notes
+  song_load(argv[arg], &song);
+  if (text && song.sample_rate != SAMPLES_PER_SECOND) {  // Text songs are timed at 44.1 KHz
+    song_set_rate(&song, SAMPLES_PER_SECOND);
+  }
+
+  FILE *out = fopen(argv[arg + 1], "wb");
+  if (out == NULL) {
+    song_free(&song);
+    fatal_error("Cannot open output file");
+  }
+  if (text) {
+    songfile_write_text(&song, out);
+  }
+  else {
+    songfile_write_binary(&song, out);
+  }
+
+  song_free(&song);
+  if (fclose(out) != 0) {
+    fatal_error("Cannot write output file");
+  }
+  return 0;
+}
@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include "io.h"
+#include "wave.h"
+#include "song.h"
+#include "songfile.h"
+
+/*
+ * A binary song is a header followed by one fixed size record per
+ * event, in order of start sample, all little endian:
+ *
+ *  header:  magic "SNGB", u16 version, u16 record size, u32 samples,
+ *           u32 beat, u32 sample rate, u32 events, 8 reserved bytes
+ *  record:  u32 start, u32 length, i32 note, u32 voice, f32 amplitude,
+ *           f32 pan, u32 attack, u32 decay, f32 sustain, u32 release
+ *
+ * which is exactly SongEvent on a little endian host, so the records of
+ * a mapped file are used in place without being parsed.
+ */
+
+/*
+ * Return the little endian u32 at p.
+ */
+static uint32_t get_u32(const uint8_t *p) {
+  return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/*
+ * Return the little endian f32 at p.
+ */
+static float get_f32(const uint8_t *p) {
+  uint32_t bits = get_u32(p);
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+/*
+ * Write a float as a little endian f32.
+ */
+static void write_f32(FILE *out, float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  write_u32(out, bits);
+}
+
+/*
+ * Return nonzero if SongEvent is laid out exactly like a record on
+ * this host, so records can be read and written in place.
+ */
+static int records_in_place(void) {
+  return host_is_little_endian() && sizeof(SongEvent) == SONGFILE_RECORD &&
+    offsetof(SongEvent, start) == 0u && offsetof(SongEvent, length) == 4u &&
+    offsetof(SongEvent, note) == 8u && offsetof(SongEvent, voice) == 12u &&
+    offsetof(SongEvent, amplitude) == 16u && offsetof(SongEvent, pan) == 20u &&
+    offsetof(SongEvent, attack) == 24u && offsetof(SongEvent, decay) == 28u &&
+    offsetof(SongEvent, sustain) == 32u && offsetof(SongEvent, release) == 36u;
+}
+
+/*
+ * Read a binary song that is already in memory. When the data is a
+ * file mapping and records match SongEvent on this host, the song's
+ * events point straight into it and the song takes over the mapping,
+ * to be unmapped by song_free; otherwise the records are decoded into
+ * an event list. Calls fatal_error if the data is not a binary song
+ * this can read, or if its events are not in order of start.
+ * Parameters:
+ *  data: the bytes of the file
+ *  size: the number of bytes
+ *  mapped: nonzero if data is a private, writable file mapping
+ *  song: where the song is stored; release it with song_free
+ * Returns 1 if the song now owns the mapping and 0 if the caller still
+ * owns data.
+ */
+int songfile_read_binary(void *data, size_t size, int mapped, Song *song) {
+  const uint8_t *bytes = data;
+
+  song->events = NULL;
+  song->num_events = 0u;
+  song->max_events = 0u;
+  song->polyphony = SONG_POLYPHONY;
+  song->map = NULL;
+  song->map_size = 0u;
+
+  if (size < SONGFILE_HEADER || memcmp(bytes, SONGFILE_MAGIC, 4u) != 0) {
+    fatal_error("Not a binary song file");
+  }
+  unsigned version = bytes[4] | bytes[5] << 8;
+  unsigned record = bytes[6] | bytes[7] << 8;
+  if (version != SONGFILE_VERSION || record != SONGFILE_RECORD) {
+    fatal_error("Unsupported binary song version");
+  }
+  song->num_samples = get_u32(&bytes[8]);
+  song->beat = get_u32(&bytes[12]);
+  song->sample_rate = get_u32(&bytes[16]);
+  uint32_t num_events = get_u32(&bytes[20]);
+  if (song->sample_rate == 0u || (size - SONGFILE_HEADER) / SONGFILE_RECORD != num_events ||
+      (size - SONGFILE_HEADER) % SONGFILE_RECORD != 0u) {
+    fatal_error("Bad binary song header");
+  }
+
+  const uint8_t *records = &bytes[SONGFILE_HEADER];
+  for (uint32_t e = 1; e < num_events; e++) {  // Rendering relies on the order
+    if (get_u32(&records[(size_t) e * SONGFILE_RECORD]) <
+        get_u32(&records[(size_t) (e - 1) * SONGFILE_RECORD])) {
+      fatal_error("Binary song events are out of order");
+    }
+  }
+
+  if (mapped && records_in_place()) {  // Use the records where they are
+    song->events = (SongEvent *) (bytes + SONGFILE_HEADER);
+    song->num_events = song->max_events = num_events;
+    song->map = data;
+    song->map_size = size;
+    return 1;
+  }
+
+  song->events = malloc((num_events ? num_events : 1u) * sizeof(SongEvent));
+  if (song->events == NULL) {
+    fatal_error("Cannot allocate song events");
+  }
+  for (uint32_t e = 0; e < num_events; e++) {  // Decode each record
+    const uint8_t *r = &records[(size_t) e * SONGFILE_RECORD];
+    SongEvent *event = &song->events[e];
+    event->start = get_u32(&r[0]);
+    event->length = get_u32(&r[4]);
+    event->note = (int32_t) get_u32(&r[8]);
+    event->voice = get_u32(&r[12]);
+    event->amplitude = get_f32(&r[16]);
+    event->pan = get_f32(&r[20]);
+    event->attack = get_u32(&r[24]);
+    event->decay = get_u32(&r[28]);
+    event->sustain = get_f32(&r[32]);
+    event->release = get_u32(&r[36]);
+  }
+  song->num_events = song->max_events = num_events;
+  return 0;
+}
+
+/*
+ * Return the number of beats to write for a position or pause of at
+ * most samples, as close to it as the text parser can reach, and store
+ * the samples it parses back to in *reached. Positions stay below 2^31
+ * samples, where the parser's int conversion ends.
+ */
+static float beats_at_most(uint32_t samples, unsigned beat, uint32_t *reached) {
+  samples = samples < SONGFILE_REACH ? samples : SONGFILE_REACH;
+  float b = (float) ((double) samples / beat);
+  while (b > 0.0f && (double) (b * beat) >= (double) samples + 1.0) {  // Too far: step back
+    b = nextafterf(b, 0.0f);
+  }
+  for (int tries = 0; tries < 8; tries++) {  // Step forward while that still fits
+    float next = nextafterf(b, INFINITY);
+    if ((double) (next * beat) >= (double) samples + 1.0) {
+      break;
+    }
+    b = next;
+  }
+  *reached = (uint32_t) (int) (b * beat);  // As the text parser computes it
+  return b;
+}
+
+/*
+ * Write the directives that move the parser's start position from
+ * *pos to target: @ if it has to go back, then pauses for whatever
+ * @ could not reach exactly or that is too long for one float.
+ */
+static void write_position(FILE *out, uint32_t *pos, uint32_t target, unsigned beat) {
+  uint32_t reached;
+  if (target < *pos) {
+    float b = beats_at_most(target, beat, &reached);
+    fprintf(out, "@ %.9g\n", b);
+    *pos = reached;
+  }
+  while (*pos < target) {
+    float b = beats_at_most(target - *pos, beat, &reached);
+    if (reached == 0u) {
+      fatal_error("Cannot write a note position in beats");
+    }
+    fprintf(out, "P %.9g\n", b);
+    *pos += reached;
+  }
+}
+
+/*
+ * Write a song, whose events are in order of start, as a binary song.
+ * Parameters:
+ *  song: the song to write
+ *  out: the output stream
+ */
+void songfile_write_binary(const Song *song, FILE *out) {
+  write_bytes(out, SONGFILE_MAGIC, 4u);
+  write_u16(out, SONGFILE_VERSION);
+  write_u16(out, SONGFILE_RECORD);
+  write_u32(out, song->num_samples);
+  write_u32(out, song->beat);
+  write_u32(out, song->sample_rate);
+  write_u32(out, song->num_events);
+  write_u32(out, 0u);
+  write_u32(out, 0u);
+
+  if (records_in_place()) {
+    if (fwrite(song->events, SONGFILE_RECORD, song->num_events, out) != song->num_events) {
+      fatal_error("Cannot write binary song");
+    }
+    return;
+  }
+  for (unsigned e = 0; e < song->num_events; e++) {  // Encode each record
+    const SongEvent *event = &song->events[e];
+    write_u32(out, event->start);
+    write_u32(out, event->length);
+    write_u32(out, (uint32_t) event->note);
+    write_u32(out, event->voice);
+    write_f32(out, event->amplitude);
+    write_f32(out, event->pan);
+    write_u32(out, event->attack);
+    write_u32(out, event->decay);
+    write_f32(out, event->sustain);
+    write_u32(out, event->release);
+  }
+}
+
+/*
+ * Return the number of beats to write for a length in samples: the
+ * float nearest samples / beat, nudged until the text parser turns it
+ * back into exactly samples. Clears *exact if no float does, which can
+ * only happen for lengths beyond about 2^24 samples.
+ */
+static float beats_for(uint32_t samples, unsigned beat, int *exact) {
+  float b = (float) ((double) samples / beat);
+  for (int tries = 0; tries < 8 && (double) b * beat < 2147483647.0; tries++) {
+    int length = (int) (b * beat);  // As the text parser computes it
+    if ((uint32_t) length == samples) {
+      return b;
+    }
+    b = nextafterf(b, (uint32_t) length < samples ? INFINITY : 0.0f);
+  }
+  *exact = 0;
+  return (float) ((double) samples / beat);
+}
+
+/*
+ * Write a song, whose events are in order of start and timed at
+ * 44.1 KHz, in the text format. Voice, amplitude, stereo position and
+ * envelope directives are written only when they change; notes that
+ * start together with the same length and settings become one chord;
+ * gaps become pauses; and a note that starts before the previous one
+ * has ended is placed with @, followed by a short pause where @ cannot
+ * name its sample exactly. Positions always parse back to exactly the
+ * same samples, and so do lengths; a warning is printed if a length
+ * could not.
+ * Parameters:
+ *  song: the song to write
+ *  out: the output stream
+ */
+void songfile_write_text(const Song *song, FILE *out) {
+  if (song->beat == 0u) {
+    fatal_error("Song has no beat length to write lengths in");
+  }
+  if (song->sample_rate != SAMPLES_PER_SECOND) {
+    fatal_error("Text songs are timed at 44.1 KHz");
+  }
+
+  int exact = 1;
+  fprintf(out, "%u %u\n", song->num_samples, song->beat);
+
+  SongEvent state;  // What the parser's current settings are
+  state.voice = 0u;
+  state.amplitude = 0.1f;
+  state.pan = 0.0f;
+  state.attack = 0u;
+  state.decay = 0u;
+  state.sustain = 1.0f;
+  state.release = 0u;
+  uint32_t cursor = 0u;
+
+  for (unsigned e = 0; e < song->num_events; ) {
+    const SongEvent *event = &song->events[e];
+    unsigned group = 1u;  // Notes that can share one chord line
+    while (e + group < song->num_events && event->note != 999) {
+      const SongEvent *other = &song->events[e + group];
+      if (other->start != event->start || other->length != event->length ||
+          other->voice != event->voice || other->amplitude != event->amplitude ||
+          other->pan != event->pan || other->attack != event->attack ||
+          other->decay != event->decay || other->sustain != event->sustain ||
+          other->release != event->release || other->note == 999) {
+        break;
+      }
+      group++;
+    }
+
+    if (event->voice != state.voice) {
+      fprintf(out, "V %u\n", event->voice);
+    }
+    if (event->amplitude != state.amplitude) {
+      fprintf(out, "A %.9g\n", event->amplitude);
+    }
+    if (event->pan != state.pan) {
+      fprintf(out, "S %.9g\n", event->pan);
+    }
+    if (event->attack != state.attack || event->decay != state.decay ||
+        event->sustain != state.sustain || event->release != state.release) {
+      fprintf(out, "E %.9g %.9g %.9g %.9g\n", beats_for(event->attack, song->beat, &exact),
+              beats_for(event->decay, song->beat, &exact), event->sustain,
+              beats_for(event->release, song->beat, &exact));
+    }
+    state = *event;
+
+    write_position(out, &cursor, event->start, song->beat);
+
+    float length = beats_for(event->length, song->beat, &exact);
+    if (group == 1u) {
+      fprintf(out, "N %.9g %d\n", length, event->note);
+    }
+    else {
+      fprintf(out, "C %.9g", length);
+      for (unsigned n = 0; n < group; n++) {
+        fprintf(out, " %d", song->events[e + n].note);
+      }
+      fprintf(out, " 999\n");
+    }
+    cursor = event->start + event->length;
+    e += group;
+  }
+
+  if (!exact) {
+    fprintf(stderr, "Warning: some lengths are too long to write exactly in beats\n");
+  }
+}
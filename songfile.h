@@ -0,0 +1,18 @@
+#ifndef SONGFILE_H
+#define SONGFILE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "song.h"
+
+#define SONGFILE_MAGIC   "SNGB"  /* first four bytes of a binary song */
+#define SONGFILE_VERSION 1u
+#define SONGFILE_HEADER  32u     /* bytes before the first event record */
+#define SONGFILE_RECORD  40u     /* bytes per event record */
+#define SONGFILE_REACH   0x7f000000u  /* furthest sample one text directive moves by */
+
+int songfile_read_binary(void *data, size_t size, int mapped, Song *song);
+void songfile_write_binary(const Song *song, FILE *out);
+void songfile_write_text(const Song *song, FILE *out);
+
+#endif /* SONGFILE_H */
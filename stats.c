@@ -0,0 +1,153 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+static const char *const stage_names[NUM_STAGES] = {
+  "parse", "read", "header", "render", "mix", "write"
+};
+
+/*
+ * Counters shared by every thread. They are only ever added to, with
+ * atomic adds, so workers can record their stages without a lock.
+ */
+static struct {
+  int enabled;                 /* 0 off, 1 text report, 2 JSON report */
+  StatsMark begin;             /* when stats were enabled */
+  uint64_t begin_process_cpu;  /* process CPU time then, in ns */
+  uint64_t wall[NUM_STAGES];   /* ns per stage, summed over threads */
+  uint64_t cpu[NUM_STAGES];
+  uint64_t samples;            /* (stereo) samples written */
+  uint64_t bytes;              /* bytes of sample data written */
+} stats;
+
+/*
+ * Return a clock's time in ns.
+ */
+static uint64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/*
+ * Handle a command line option if it is --stats (a text report) or
+ * --stats=json (one line of JSON). Both are printed to stderr when
+ * the tool finishes. Returns 1 if arg was a stats option.
+ */
+int stats_option(const char *arg) {
+  if (strcmp(arg, "--stats") == 0) {
+    stats.enabled = 1;
+  }
+  else if (strcmp(arg, "--stats=json") == 0) {
+    stats.enabled = 2;
+  }
+  else {
+    return 0;
+  }
+  stats_start(&stats.begin);
+  stats.begin_process_cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+  return 1;
+}
+
+/*
+ * Return nonzero if stats are being collected.
+ */
+int stats_enabled(void) {
+  return stats.enabled;
+}
+
+/*
+ * Mark the start of a stretch of work. Costs nothing but a test when
+ * stats are off.
+ */
+void stats_start(StatsMark *mark) {
+  if (stats.enabled) {
+    mark->wall = clock_ns(CLOCK_MONOTONIC);
+    mark->cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+  }
+}
+
+/*
+ * Add the time since mark to a stage. The CPU time is that of the
+ * calling thread, so stages run on worker threads are counted where
+ * they ran; with several threads a stage's times add up over all of
+ * them and can exceed the elapsed time.
+ */
+void stats_stop(const StatsMark *mark, unsigned stage) {
+  if (stats.enabled) {
+    __atomic_add_fetch(&stats.wall[stage], clock_ns(CLOCK_MONOTONIC) - mark->wall, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.cpu[stage], clock_ns(CLOCK_THREAD_CPUTIME_ID) - mark->cpu, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * Add the time since mark to a stage and restart mark, so back to
+ * back stages share one reading of each clock.
+ */
+void stats_lap(StatsMark *mark, unsigned stage) {
+  if (stats.enabled) {
+    uint64_t wall = clock_ns(CLOCK_MONOTONIC), cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    __atomic_add_fetch(&stats.wall[stage], wall - mark->wall, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.cpu[stage], cpu - mark->cpu, __ATOMIC_RELAXED);
+    mark->wall = wall;
+    mark->cpu = cpu;
+  }
+}
+
+/*
+ * Count samples and bytes of sample data written.
+ */
+void stats_add_output(uint64_t samples, uint64_t bytes) {
+  if (stats.enabled) {
+    __atomic_add_fetch(&stats.samples, samples, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stats.bytes, bytes, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * Print the collected stats to stderr: wall and CPU time per stage,
+ * totals for the whole run, samples and bytes per second and the peak
+ * resident set size. Does nothing if stats are off.
+ */
+void stats_report(const char *tool) {
+  if (!stats.enabled) {
+    return;
+  }
+
+  double wall = (clock_ns(CLOCK_MONOTONIC) - stats.begin.wall) * 1e-9;
+  double cpu = (clock_ns(CLOCK_PROCESS_CPUTIME_ID) - stats.begin_process_cpu) * 1e-9;
+  double rate = wall > 0.0 ? stats.samples / wall : 0.0;
+  double byte_rate = wall > 0.0 ? stats.bytes / wall : 0.0;
+  struct rusage usage;
+  long peak_kb = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;  /* KiB on Linux */
+
+  if (stats.enabled == 2) {
+    fprintf(stderr, "{\"tool\":\"%s\",\"stages\":{", tool);
+    for (unsigned s = 0; s < NUM_STAGES; s++) {
+      fprintf(stderr, "%s\"%s\":{\"wall_s\":%.6f,\"cpu_s\":%.6f}", s ? "," : "",
+              stage_names[s], stats.wall[s] * 1e-9, stats.cpu[s] * 1e-9);
+    }
+    fprintf(stderr, "},\"wall_s\":%.6f,\"cpu_s\":%.6f,\"samples\":%llu,\"bytes\":%llu,"
+            "\"samples_per_s\":%.1f,\"bytes_per_s\":%.1f,\"peak_rss_kb\":%ld}\n",
+            wall, cpu, (unsigned long long) stats.samples, (unsigned long long) stats.bytes,
+            rate, byte_rate, peak_kb);
+    return;
+  }
+
+  fprintf(stderr, "%s stats\n", tool);
+  fprintf(stderr, "  %-8s %12s %12s\n", "stage", "wall s", "cpu s");
+  for (unsigned s = 0; s < NUM_STAGES; s++) {
+    if (stats.wall[s] > 0u || stats.cpu[s] > 0u) {
+      fprintf(stderr, "  %-8s %12.6f %12.6f\n", stage_names[s], stats.wall[s] * 1e-9, stats.cpu[s] * 1e-9);
+    }
+  }
+  fprintf(stderr, "  %-8s %12.6f %12.6f\n", "total", wall, cpu);
+  fprintf(stderr, "  %llu samples, %.3f Msamples/s\n", (unsigned long long) stats.samples, rate / 1e6);
+  fprintf(stderr, "  %llu bytes, %.3f MB/s\n", (unsigned long long) stats.bytes, byte_rate / 1e6);
+  fprintf(stderr, "  peak RSS %ld KiB\n", peak_kb);
+}
@@ -0,0 +1,29 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+
+/* stages of a tool's work that are timed separately */
+#define STAGE_PARSE  0 /* reading the song file or input headers */
+#define STAGE_READ   1 /* reading input samples */
+#define STAGE_HEADER 2 /* writing the output header */
+#define STAGE_RENDER 3 /* generating voices or running effects */
+#define STAGE_MIX    4 /* converting the mix bus to output samples */
+#define STAGE_WRITE  5 /* writing output samples */
+#define NUM_STAGES   6
+
+/* start of a timed stretch of work */
+typedef struct {
+  uint64_t wall;  /* monotonic clock, in ns */
+  uint64_t cpu;   /* CPU time of the calling thread, in ns */
+} StatsMark;
+
+int stats_option(const char *arg);
+int stats_enabled(void);
+void stats_start(StatsMark *mark);
+void stats_stop(const StatsMark *mark, unsigned stage);
+void stats_lap(StatsMark *mark, unsigned stage);
+void stats_add_output(uint64_t samples, uint64_t bytes);
+void stats_report(const char *tool);
+
+#endif /* STATS_H */
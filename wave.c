@@ -4,30 +4,108 @@
 #include <math.h>
 #include "io.h"
 #include "wave.h"
+#include "mix.h"
+#include "wavetable.h"
+
+#define OSC_PHASE_ONE  4294967296.0 /* one full cycle of oscillator phase */
+#define OSC_PHASE_HALF 0x80000000u  /* half a cycle of oscillator phase */
+#define OSC_MAX        32767.0      /* sample value for amplitude 1.0 */
+#define OSC_BLOCK      256u         /* samples generated per block */
+#define OSC_RESYNC     1024u        /* samples between exact sine resyncs */
+#define OSC_WT_FRAC_MASK  ((1u << (32u - WT_BITS)) - 1u) /* phase bits between table entries */
+#define OSC_WT_FRAC_SCALE (1.0 / (1u << (32u - WT_BITS)))
 
 /*
- * Write a WAVE file header to given output stream.
- * Format is hard-coded as 44.1 KHz sample rate, 16 bit
- * signed samples, two channels.
+ * Fill in a sample format. block_align follows from the channel
+ * count and bit depth; the data fields are cleared.
+ * Parameters:
+ *   format - the format to fill in
+ *   sample_rate - samples per second per channel
+ *   channels - the number of interleaved channels
+ *   bits_per_sample - 16 or 24 for PCM, 32 for float
+ *   code - WAVE_FORMAT_PCM or WAVE_FORMAT_IEEE_FLOAT
+ */
+void wave_format_init(WaveFormat *format, uint32_t sample_rate,
+                      unsigned channels, unsigned bits_per_sample,
+                      unsigned code) {
+  format->format = (uint16_t) code;
+  format->channels = (uint16_t) channels;
+  format->sample_rate = sample_rate;
+  format->bits_per_sample = (uint16_t) bits_per_sample;
+  format->block_align = (uint16_t) (channels * (bits_per_sample / 8u));
+  format->data_offset = 0;
+  format->data_size = 0u;
+}
+
+/*
+ * Parse an output format given as rate:channels:depth, for example
+ * 22050:1:16, 96000:2:24 or 48000:2:f32. The renderers mix mono or
+ * stereo, so channels must be 1 or 2.
+ * Parameters:
+ *   spec - the text to parse
+ *   format - where the format is stored
+ * Returns 1 if spec is a supported format and 0 otherwise.
+ */
+int wave_format_parse(const char *spec, WaveFormat *format) {
+  unsigned rate, channels;
+  int end = 0;
+  char depth[4];
+
+  if (sscanf(spec, "%u:%u:%3[0-9f]%n", &rate, &channels, depth, &end) != 3 ||
+      spec[end] != '\0') {
+    return 0;
+  }
+  if (rate < 1000u || rate > 384000u || channels < 1u || channels > WAVE_MAX_CHANNELS) {
+    return 0;
+  }
+
+  if (strcmp(depth, "16") == 0) {
+    wave_format_init(format, rate, channels, 16u, WAVE_FORMAT_PCM);
+  }
+  else if (strcmp(depth, "24") == 0) {
+    wave_format_init(format, rate, channels, 24u, WAVE_FORMAT_PCM);
+  }
+  else if (strcmp(depth, "f32") == 0) {
+    wave_format_init(format, rate, channels, 32u, WAVE_FORMAT_IEEE_FLOAT);
+  }
+  else {
+    return 0;
+  }
+  return 1;
+}
+
+/*
+ * Write a WAVE file header for the given format to given output
+ * stream. PCM headers are the canonical 44 bytes; IEEE float headers
+ * have the 18 byte fmt chunk and the fact chunk that format requires,
+ * 58 bytes in all. Calls fatal_error, before writing anything, if the
+ * samples would not fit in a WAVE file's 32 bit sizes (4 GiB).
  *
  * Parameters:
  *   out - the output stream
- *   num_samples - the number of (stereo) samples that will follow
+ *   format - the format of the samples that will follow
+ *   num_frames - the number of sample frames (one sample for every
+ *      channel) that will follow
  */
-void write_wave_header(FILE *out, unsigned num_samples) {
+void write_wave_format(FILE *out, const WaveFormat *format,
+                       unsigned num_frames) {
   /*
    * See: http://soundfile.sapp.org/doc/WaveFormat/
    */
 
   uint32_t ChunkSize, Subchunk1Size, Subchunk2Size;
-  uint16_t NumChannels = NUM_CHANNELS;
-  uint32_t ByteRate = SAMPLES_PER_SECOND * NumChannels * (BITS_PER_SAMPLE/8u);
-  uint16_t BlockAlign = NumChannels * (BITS_PER_SAMPLE/8u);
+  uint32_t ByteRate = format->sample_rate * format->block_align;
+  int is_float = format->format == WAVE_FORMAT_IEEE_FLOAT;
 
   /* Subchunk2Size is the total amount of sample data */
-  Subchunk2Size = num_samples * NumChannels * (BITS_PER_SAMPLE/8u);
-  Subchunk1Size = 16u;
-  ChunkSize = 4u + (8u + Subchunk1Size) + (8u + Subchunk2Size);
+  uint64_t data_size = (uint64_t) num_frames * format->block_align;
+  Subchunk1Size = is_float ? 18u : 16u;
+  uint64_t chunk_size = 4u + (8u + Subchunk1Size) + (is_float ? 8u + 4u : 0u) + (8u + data_size);
+  if (chunk_size > UINT32_MAX) {
+    fatal_error("Output is too long for a WAVE file (4 GiB)");
+  }
+  Subchunk2Size = (uint32_t) data_size;
+  ChunkSize = (uint32_t) chunk_size;
 
   /* Write the RIFF chunk descriptor */
   write_bytes(out, "RIFF", 4u);
@@ -37,12 +115,20 @@ void write_wave_header(FILE *out, unsigned num_samples) {
   /* Write the "fmt " sub-chunk */
   write_bytes(out, "fmt ", 4u);       /* Subchunk1ID */
   write_u32(out, Subchunk1Size);
-  write_u16(out, 1u);                 /* PCM format */
-  write_u16(out, NumChannels);
-  write_u32(out, SAMPLES_PER_SECOND); /* SampleRate */
+  write_u16(out, format->format);
+  write_u16(out, format->channels);
+  write_u32(out, format->sample_rate);
   write_u32(out, ByteRate);
-  write_u16(out, BlockAlign);
-  write_u16(out, BITS_PER_SAMPLE);
+  write_u16(out, format->block_align);
+  write_u16(out, format->bits_per_sample);
+  if (is_float) {
+    write_u16(out, 0u);               /* cbSize: no extension */
+
+    /* Non-PCM formats also need a "fact" chunk with the frame count */
+    write_bytes(out, "fact", 4u);
+    write_u32(out, 4u);
+    write_u32(out, num_frames);
+  }
 
   /* Write the beginning of the "data" sub-chunk, but not the actual data */
   write_bytes(out, "data", 4);        /* Subchunk2ID */
@@ -50,22 +136,113 @@ void write_wave_header(FILE *out, unsigned num_samples) {
 }
 
 /*
- * Read a WAVE header from given input stream.
- * Calls fatal_error if data can't be read, if the data
- * doesn't follow the WAVE format, or if the audio
- * parameters of the input WAVE aren't 44.1 KHz, 16 bit
- * signed samples, and two channels.
+ * Write a WAVE file header to given output stream.
+ * Format is hard-coded as 44.1 KHz sample rate, 16 bit
+ * signed samples, two channels.
  *
  * Parameters:
- *   in - the input stream
- *   num_samples - pointer to an unsigned variable where the
- *      number of (stereo) samples following the header
- *      should be stored
+ *   out - the output stream
+ *   num_samples - the number of (stereo) samples that will follow
  */
-void read_wave_header(FILE *in, unsigned *num_samples) {
+void write_wave_header(FILE *out, unsigned num_samples) {
+  WaveFormat format;
+  wave_format_init(&format, SAMPLES_PER_SECOND, NUM_CHANNELS, BITS_PER_SAMPLE, WAVE_FORMAT_PCM);
+  write_wave_format(out, &format, num_samples);
+}
+
+/*
+ * Convert interleaved values of a float mix bus to the sample
+ * encoding of a format, in file byte order. 16 bit output is the
+ * common case and goes straight through mix_f32_to_s16; dither is
+ * only applied there, since 24 bit and float output have no audible
+ * quantization error to decorrelate.
+ * Parameters:
+ *   format - the output format
+ *   dst - where num_values * (bits_per_sample / 8) bytes are stored,
+ *         aligned for int16_t since 16 bit samples are stored directly
+ *   bus - the mix bus, in 16 bit sample units
+ *   num_values - the number of values (frames times channels) in bus
+ *   dither - nonzero to apply TPDF dither to 16 bit output
+ *   seed - the dither seed, for example the position of the block
+ */
+void wave_encode(const WaveFormat *format, uint8_t dst[], const float bus[],
+                 unsigned num_values, int dither, uint32_t seed) {
+  if (format->bits_per_sample == 16u) {
+    int16_t *samples = (int16_t *) (void *) dst;
+    if (dither) {
+      mix_f32_to_s16_tpdf(samples, bus, num_values, seed);
+    }
+    else {
+      mix_f32_to_s16(samples, bus, num_values);
+    }
+    if (!host_is_little_endian()) {  // Put the bytes in file order
+      for (unsigned i = 0; i < num_values; i++) {
+        uint8_t low = dst[2 * i + 1];
+        dst[2 * i + 1] = dst[2 * i];
+        dst[2 * i] = low;
+      }
+    }
+  }
+  else if (format->bits_per_sample == 24u) {
+    mix_f32_to_s24(dst, bus, num_values);
+  }
+  else {
+    mix_f32_to_f32(dst, bus, num_values);
+  }
+}
+
+/*
+ * Skip n bytes of the input stream, seeking when the stream allows it
+ * and reading otherwise (pipes).
+ */
+static void skip_bytes(FILE *in, uint32_t n) {
+  if (n <= 0x7fffffffu && fseek(in, (long) n, SEEK_CUR) == 0) {
+    return;
+  }
+  char discard[256];
+  while (n > 0) {
+    unsigned count = n < sizeof discard ? n : (unsigned) sizeof discard;
+    read_bytes(in, discard, count);
+    n -= count;
+  }
+}
+
+/*
+ * Read the header of the next chunk of a RIFF file.
+ * Returns 0 if the stream ends before another chunk starts.
+ */
+static int read_chunk_header(FILE *in, char id[4], uint32_t *size) {
+  if (fread(id, 1u, 4u, in) != 4u) {
+    return 0;
+  }
+  read_u32(in, size);
+  return 1;
+}
+
+/*
+ * Read the header of a WAVE file from given input stream, walking its
+ * chunks up to the start of the sample data. Chunks other than
+ * "fmt " and "data" (LIST, fact, cue, ...) are skipped by size. Both
+ * the plain and the WAVE_FORMAT_EXTENSIBLE layouts of "fmt " are
+ * accepted; for the latter the sub-format is stored as the format.
+ * Calls fatal_error if data can't be read or if the data doesn't
+ * follow the WAVE format. The audio parameters are not checked.
+ *
+ * Parameters:
+ *   in - the input stream, left positioned at the first sample
+ *   format - where the format of the sample data is stored
+ */
+void read_wave_format(FILE *in, WaveFormat *format) {
+  static const unsigned char ExtensibleSuffix[14] = {  /* KSDATAFORMAT_SUBTYPE GUID after the format code */
+    0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+  };
   char label_buf[4];
-  uint32_t ChunkSize, Subchunk1Size, SampleRate, ByteRate, Subchunk2Size;
-  uint16_t AudioFormat, NumChannels, BlockAlign, BitsPerSample;
+  uint32_t ChunkSize, ByteRate;
+  uint16_t ExtensionSize, ValidBits;
+  uint32_t ChannelMask;
+  char SubFormat[16];
+  int have_fmt = 0;
+  long offset = 12;  /* bytes read so far */
 
   read_bytes(in, label_buf, 4u);
   if (memcmp(label_buf, "RIFF", 4u) != 0) {
@@ -79,109 +256,481 @@ void read_wave_header(FILE *in, unsigned *num_samples) {
     fatal_error("Bad wave header (no WAVE label)");
   }
 
-  read_bytes(in, label_buf, 4u);
-  if (memcmp(label_buf, "fmt ", 4u) != 0) {
-    fatal_error("Bad wave header (no 'fmt ' subchunk ID)");
+  for (;;) {
+    if (!read_chunk_header(in, label_buf, &ChunkSize)) {
+      fatal_error(have_fmt ? "Bad wave header (no 'data' subchunk ID)"
+                           : "Bad wave header (no 'fmt ' subchunk ID)");
+    }
+    offset += 8;
+
+    if (memcmp(label_buf, "data", 4u) == 0) {
+      if (!have_fmt) {
+        fatal_error("Bad wave header (no 'fmt ' subchunk ID)");
+      }
+      break;
+    }
+
+    /* chunks are padded to an even size */
+    uint32_t padded = ChunkSize + (ChunkSize & 1u);
+    if (memcmp(label_buf, "fmt ", 4u) != 0) {
+      skip_bytes(in, padded);
+      offset += (long) padded;
+      continue;
+    }
+
+    if (ChunkSize < 16u) {
+      fatal_error("Bad wave header (fmt subchunk too short)");
+    }
+    read_u16(in, &format->format);
+    read_u16(in, &format->channels);
+    read_u32(in, &format->sample_rate);
+    read_u32(in, &ByteRate); /* ignore */
+    read_u16(in, &format->block_align);
+    read_u16(in, &format->bits_per_sample);
+    uint32_t used = 16u;
+
+    if (format->format == WAVE_FORMAT_EXTENSIBLE) {
+      if (ChunkSize < 40u) {
+        fatal_error("Bad wave header (extensible fmt subchunk too short)");
+      }
+      read_u16(in, &ExtensionSize);
+      read_u16(in, &ValidBits); /* ignore, samples are stored in bits_per_sample */
+      read_u32(in, &ChannelMask); /* ignore */
+      read_bytes(in, SubFormat, 16u);
+      used = 40u;
+      if (ExtensionSize < 22u || memcmp(&SubFormat[2], ExtensibleSuffix, 14u) != 0) {
+        fatal_error("Bad wave header (unknown extensible sub-format)");
+      }
+      format->format = (uint16_t) ((unsigned char) SubFormat[0] | (unsigned char) SubFormat[1] << 8);
+    }
+
+    skip_bytes(in, padded - used);
+    offset += (long) padded;
+    have_fmt = 1;
   }
 
-  read_u32(in, &Subchunk1Size);
-  if (Subchunk1Size != 16u) {
-    fatal_error("Bad wave header (Subchunk1Size was not 16)");
+  if (format->channels == 0u || format->bits_per_sample == 0u) {
+    fatal_error("Bad wave header (no channels or zero bits per sample)");
   }
+  format->data_offset = offset;
+  format->data_size = ChunkSize;
+}
 
-  read_u16(in, &AudioFormat);
-  if (AudioFormat != 1u) {
+/*
+ * Read a WAVE header from given input stream.
+ * Calls fatal_error if data can't be read, if the data
+ * doesn't follow the WAVE format, or if the audio
+ * parameters of the input WAVE aren't 44.1 KHz, 16 bit
+ * signed samples, and two channels.
+ *
+ * Parameters:
+ *   in - the input stream
+ *   num_samples - pointer to an unsigned variable where the
+ *      number of (stereo) samples following the header
+ *      should be stored
+ */
+void read_wave_header(FILE *in, unsigned *num_samples) {
+  WaveFormat format;
+  read_wave_format(in, &format);
+
+  if (format.format != WAVE_FORMAT_PCM) {
     fatal_error("Bad wave header (AudioFormat is not PCM)");
   }
-
-  read_u16(in, &NumChannels);
-  if (NumChannels != NUM_CHANNELS) {
+  if (format.channels != NUM_CHANNELS) {
     fatal_error("Bad wave header (NumChannels is not 2)");
   }
-
-  read_u32(in, &SampleRate);
-  if (SampleRate != SAMPLES_PER_SECOND) {
+  if (format.sample_rate != SAMPLES_PER_SECOND) {
     fatal_error("Bad wave header (Unexpected sample rate)");
   }
+  if (format.bits_per_sample != BITS_PER_SAMPLE) {
+    fatal_error("Bad wave header (Unexpected bits per sample)");
+  }
 
-  read_u32(in, &ByteRate); /* ignore */
+  *num_samples = format.data_size / NUM_CHANNELS / (BITS_PER_SAMPLE/8u);
+}
 
-  read_u16(in, &BlockAlign); /* ignore */
+/*
+ * Convert an oscillator phase (one full cycle is 2^32) to radians.
+ */
+static double phase_to_radians(uint32_t phase) {
+  return 2.0 * PI * ((double) phase / OSC_PHASE_ONE);
+}
 
-  read_u16(in, &BitsPerSample);
-  if (BitsPerSample != BITS_PER_SAMPLE) {
-    fatal_error("Bad wave header (Unexpected bits per sample)");
+/*
+ * Set up an oscillator at phase zero for 44.1 KHz output.
+ * Parameters:
+ *  osc: the oscillator to initialize
+ *  freq_hz: the frequency of the generated waveform in Hz (cycles per second)
+ *  amplitude: the relative amplitude of the generated waveform, where 1.0 is
+ *             the maximum possible amplitude
+ *  voice: indicates which waveform to generate
+ */
+void osc_init(Oscillator *osc, float freq_hz, float amplitude,
+	      unsigned voice) {
+  osc_init_rate(osc, freq_hz, amplitude, voice, SAMPLES_PER_SECOND);
+}
+
+/*
+ * Set up an oscillator at phase zero for output at any sample rate.
+ * Parameters:
+ *  osc: the oscillator to initialize
+ *  freq_hz: the frequency of the generated waveform in Hz (cycles per second)
+ *  amplitude: the relative amplitude of the generated waveform, where 1.0 is
+ *             the maximum possible amplitude
+ *  voice: indicates which waveform to generate
+ *  sample_rate: the output sample rate in samples per second
+ */
+void osc_init_rate(Oscillator *osc, float freq_hz, float amplitude,
+		   unsigned voice, uint32_t sample_rate) {
+  /* phase advance per sample as a fraction of a cycle, wrapped to [0, 1) */
+  double cycles = fmod((double) freq_hz / (double) sample_rate, 1.0);
+  if (cycles < 0.0) {
+    cycles += 1.0;
   }
 
-  read_bytes(in, label_buf, 4u);
-  if (memcmp(label_buf, "data", 4u) != 0) {
-    fatal_error("Bad wave header (no 'data' subchunk ID)");
+  osc->phase = 0u;
+  osc->phase_inc = (uint32_t) (uint64_t) (cycles * OSC_PHASE_ONE + 0.5);
+  osc->amplitude = amplitude * OSC_MAX;
+  osc->voice = voice;
+  osc->resync = 0u;
+  osc->sin_val = 0.0;
+  osc->cos_val = 1.0;
+  osc->rot_sin = sin(phase_to_radians(osc->phase_inc));
+  osc->rot_cos = cos(phase_to_radians(osc->phase_inc));
+  osc->table = NULL;
+
+  switch (voice) {  // Wavetable voices pick their table once, up front
+  case WT_SINE:
+    osc->table = wavetable_lookup(SINE, cycles);
+    break;
+  case WT_SQUARE:
+    osc->table = wavetable_lookup(SQUARE, cycles);
+    break;
+  case WT_SAW:
+    osc->table = wavetable_lookup(SAW, cycles);
+    break;
+  default:
+    break;
+  }
+}
+
+/*
+ * Generate the next n samples of an oscillator into out[], in
+ * sample units, and advance its phase.
+ * The sine voice rotates a (cos, sin) phasor instead of calling
+ * sin() per sample. The phasor is recomputed exactly from the
+ * integer phase every OSC_RESYNC samples, so rounding error
+ * never accumulates and long renders stay bit stable.
+ */
+static void osc_generate(Oscillator *osc, float out[], unsigned n) {
+  uint32_t phase = osc->phase;
+  uint32_t inc = osc->phase_inc;
+  double amp = osc->amplitude;
+
+  switch (osc->voice) {
+  case SINE:
+    for (unsigned i = 0; i < n; ) {
+      if (osc->resync == 0u) {  // Start a new run from the exact phase
+        osc->sin_val = sin(phase_to_radians(phase));
+        osc->cos_val = cos(phase_to_radians(phase));
+        osc->resync = OSC_RESYNC;
+      }
+
+      unsigned run = n - i < osc->resync ? n - i : osc->resync;
+      double s = osc->sin_val, c = osc->cos_val;
+      for (unsigned j = 0; j < run; j++, i++) {
+        out[i] = (float) (amp * s);
+        double next_s = s * osc->rot_cos + c * osc->rot_sin;
+        c = c * osc->rot_cos - s * osc->rot_sin;
+        s = next_s;
+      }
+      osc->sin_val = s;
+      osc->cos_val = c;
+      osc->resync -= run;
+      phase += inc * run;
+    }
+    break;
+  case SQUARE:
+    for (unsigned i = 0; i < n; i++, phase += inc) {
+      out[i] = (float) (phase < OSC_PHASE_HALF ? amp : -amp);
+    }
+    break;
+  case SAW:
+    for (unsigned i = 0; i < n; i++, phase += inc) {
+      out[i] = (float) (-amp + 2.0 * amp * ((double) phase / OSC_PHASE_ONE));
+    }
+    break;
+  case WT_SINE:
+  case WT_SQUARE:
+  case WT_SAW:
+    for (unsigned i = 0; i < n; i++, phase += inc) {  // Linear interpolation between table entries
+      uint32_t index = phase >> (32u - WT_BITS);
+      float frac = (float) (phase & OSC_WT_FRAC_MASK) * (float) OSC_WT_FRAC_SCALE;
+      float a = osc->table[index];
+      out[i] = (float) amp * (a + frac * (osc->table[index + 1u] - a));
+    }
+    break;
+  default:
+    for (unsigned i = 0; i < n; i++) {
+      out[i] = 0.0f;
+    }
+    phase += inc * n;
+    break;
   }
 
-  /* finally we're at the Subchunk2Size field, from which we can
-   * determine the number of samples */
-  read_u32(in, &Subchunk2Size);
-  *num_samples = Subchunk2Size / NUM_CHANNELS / (BITS_PER_SAMPLE/8u);
+  osc->phase = phase;
 }
 
 /*
- * Generate a sine wave of the specified frequency into the specified sample
- * buffer.
+ * Convert a generated sample to int16_t, truncating toward zero
+ * and saturating values outside the int16_t range.
+ */
+static int16_t to_s16(float value) {
+  if (value >= (float) INT16_MAX) {
+    return INT16_MAX;
+  }
+  if (value <= (float) INT16_MIN) {
+    return INT16_MIN;
+  }
+  return (int16_t) value;
+}
+
+/*
+ * Render the next num_samples samples of an oscillator into one
+ * channel of the specified stereo sample buffer, adding them to
+ * what is already there.
  * Parameters:
+ *  osc: the oscillator to render from
  *  buf: the pointer to the the sample buffer
- *  num_samples: the number of samples in the buffer; specifies the duration of
- *               the rendered audio waveform
+ *  num_samples: the number of samples to render
  *  channel: indicates which channel to generate
- *  freq_hz: the frequency of the generated waveform in Hz (cycles per second)
- *  amplitude: the relative amplitude of the generated waveform, where 1.0 is 
- *             the maximum possible amplitude
- *
  */
+void osc_render(Oscillator *osc, int16_t buf[], unsigned num_samples,
+		unsigned channel) {
+  float block[OSC_BLOCK];
+  int16_t stage[2 * OSC_BLOCK];
 
-void render_sine_wave(int16_t buf[], unsigned num_samples, unsigned channel,
-		      float freq_hz, float amplitude) {
-  int max = 32768;
-  double time_per_sample = 1.0 / (double) SAMPLES_PER_SECOND;
-  if (channel == 0) {
-
-    for (unsigned i = 0; i < num_samples * 2; i += 2) {
-      int16_t amp = (int16_t)(amplitude / 1.0 * max *
-			      sin(2 * PI * freq_hz * (i / 2) * time_per_sample));
-      if ((int) amp + (int) buf[i] > max) {
-        buf[i] = (int16_t) max;
-      }
-      else if ((int) amp + (int) buf[i] < -max) {
-        buf[i] = (int16_t) -max;
-      }
-      else {
-        buf[i] += amp;
-      }
-      
+  if (channel > 1) {
+    return;
+  }
+
+  while (num_samples > 0) {  // Generate and mix one block at a time
+    unsigned count = num_samples < OSC_BLOCK ? num_samples : OSC_BLOCK;
+    osc_generate(osc, block, count);
+
+    for (unsigned i = 0; i < count; i++) {
+      stage[2 * i + channel] = to_s16(block[i]);
+      stage[2 * i + (1 - channel)] = 0;
+    }
+    mix_s16(buf, stage, 2 * count);
+
+    buf += 2 * count;
+    num_samples -= count;
+  }
+}
+
+/*
+ * Render the next num_samples samples of an oscillator into both
+ * channels of the specified stereo sample buffer, adding them to
+ * what is already there. Each sample is generated once and the
+ * left/right pair is written together.
+ * Parameters:
+ *  osc: the oscillator to render from
+ *  buf: the pointer to the the sample buffer
+ *  num_samples: the number of samples to render
+ *  gain_l: the gain applied to the left channel (channel 0)
+ *  gain_r: the gain applied to the right channel (channel 1)
+ */
+void osc_render_stereo(Oscillator *osc, int16_t buf[], unsigned num_samples,
+		       float gain_l, float gain_r) {
+  float block[OSC_BLOCK];
+  int16_t stage[2 * OSC_BLOCK];
+
+  while (num_samples > 0) {  // Generate and mix one block at a time
+    unsigned count = num_samples < OSC_BLOCK ? num_samples : OSC_BLOCK;
+    osc_generate(osc, block, count);
+
+    for (unsigned i = 0; i < count; i++) {
+      stage[2 * i] = to_s16(block[i] * gain_l);
+      stage[2 * i + 1] = to_s16(block[i] * gain_r);
     }
+    mix_s16(buf, stage, 2 * count);
+
+    buf += 2 * count;
+    num_samples -= count;
   }
-  
-  else if (channel == 1) {
+}
 
-    for	(unsigned i = 1; i < num_samples * 2; i += 2) {
-      int16_t amp = (int16_t)(amplitude / 1.0 * max *
-			      sin(2 * PI * freq_hz * (i / 2) * time_per_sample));
+/*
+ * Render the next num_samples samples of an oscillator into both
+ * channels of a float mix bus, adding them to what is already there.
+ * Nothing is rounded or clamped; the bus is converted to int16_t once,
+ * after every voice has been added.
+ * Parameters:
+ *  osc: the oscillator to render from
+ *  bus: the interleaved stereo mix bus
+ *  num_samples: the number of (stereo) samples to render
+ *  gain_l: the gain applied to the left channel (channel 0)
+ *  gain_r: the gain applied to the right channel (channel 1)
+ */
+void osc_mix_stereo(Oscillator *osc, float bus[], unsigned num_samples,
+		    float gain_l, float gain_r) {
+  float block[OSC_BLOCK];
 
-      if ((int) amp + (int) buf[i] > max) {
-      	buf[i] = (int16_t) max;
-      }
-      else if ((int) amp + (int) buf[i] < -max)	{
-      	buf[i] = (int16_t) -max;
+  while (num_samples > 0) {  // Generate and mix one block at a time
+    unsigned count = num_samples < OSC_BLOCK ? num_samples : OSC_BLOCK;
+    osc_generate(osc, block, count);
+
+    for (unsigned i = 0; i < count; i++) {
+      bus[2 * i] += block[i] * gain_l;
+      bus[2 * i + 1] += block[i] * gain_r;
+    }
+
+    bus += 2 * count;
+    num_samples -= count;
+  }
+}
+
+/*
+ * Render the next num_samples samples of an oscillator into a mono
+ * float mix bus, adding them to what is already there.
+ * Parameters:
+ *  osc: the oscillator to render from
+ *  bus: the mono mix bus
+ *  num_samples: the number of samples to render
+ *  gain: the gain applied to the samples
+ */
+void osc_mix_mono(Oscillator *osc, float bus[], unsigned num_samples,
+		  float gain) {
+  float block[OSC_BLOCK];
+
+  while (num_samples > 0) {  // Generate and mix one block at a time
+    unsigned count = num_samples < OSC_BLOCK ? num_samples : OSC_BLOCK;
+    osc_generate(osc, block, count);
+
+    for (unsigned i = 0; i < count; i++) {
+      bus[i] += block[i] * gain;
+    }
+
+    bus += count;
+    num_samples -= count;
+  }
+}
+
+/*
+ * Render the next num_samples frames of an oscillator into a mono or
+ * stereo float mix bus. A mono bus gets the average of the two gains,
+ * which is what downmixing the stereo render would give.
+ * Parameters:
+ *  osc: the oscillator to render from
+ *  bus: the interleaved mix bus
+ *  num_samples: the number of frames to render
+ *  channels: 1 or 2, the number of channels of bus
+ *  gain_l: the gain applied to the left channel (channel 0)
+ *  gain_r: the gain applied to the right channel (channel 1)
+ */
+void osc_mix(Oscillator *osc, float bus[], unsigned num_samples,
+	     unsigned channels, float gain_l, float gain_r) {
+  if (channels == 1u) {
+    osc_mix_mono(osc, bus, num_samples, 0.5f * (gain_l + gain_r));
+  }
+  else {
+    osc_mix_stereo(osc, bus, num_samples, gain_l, gain_r);
+  }
+}
+
+/*
+ * Like osc_mix, but each frame is also scaled by its entry of a gain
+ * vector, such as an envelope computed for the block, in the same pass
+ * that generates it.
+ * Parameters:
+ *  osc: the oscillator to render from
+ *  bus: the interleaved mix bus
+ *  num_samples: the number of frames to render
+ *  channels: 1 or 2, the number of channels of bus
+ *  gain_l: the gain applied to the left channel (channel 0)
+ *  gain_r: the gain applied to the right channel (channel 1)
+ *  env: num_samples gains, one per frame
+ */
+void osc_mix_env(Oscillator *osc, float bus[], unsigned num_samples,
+		 unsigned channels, float gain_l, float gain_r, const float env[]) {
+  float block[OSC_BLOCK];
+  float gain = 0.5f * (gain_l + gain_r);
+
+  while (num_samples > 0) {  // Generate and mix one block at a time
+    unsigned count = num_samples < OSC_BLOCK ? num_samples : OSC_BLOCK;
+    osc_generate(osc, block, count);
+
+    if (channels == 1u) {
+      for (unsigned i = 0; i < count; i++) {
+        bus[i] += block[i] * env[i] * gain;
       }
-      else {
-      	buf[i] += amp;
+    }
+    else {
+      for (unsigned i = 0; i < count; i++) {
+        float value = block[i] * env[i];
+        bus[2 * i] += value * gain_l;
+        bus[2 * i + 1] += value * gain_r;
       }
+    }
 
+    bus += channels * count;
+    env += count;
+    num_samples -= count;
+  }
+}
 
-    }
+/*
+ * Advance an oscillator by num_samples samples without rendering
+ * them. The oscillator ends up in exactly the state it would have
+ * after rendering those samples, so a note can be started part way
+ * through and still match a render from its beginning bit for bit.
+ * Parameters:
+ *  osc: the oscillator to advance
+ *  num_samples: the number of samples to skip
+ */
+void osc_seek(Oscillator *osc, unsigned num_samples) {
+  float scratch[OSC_BLOCK];
+
+  if (osc->voice != SINE) {  // Only the sine phasor carries state besides the phase
+    osc->phase += osc->phase_inc * num_samples;
+    return;
+  }
+
+  if (num_samples >= osc->resync) {  // Jump to the last resync at or before the target
+    unsigned skip = osc->resync +
+      (num_samples - osc->resync) / OSC_RESYNC * OSC_RESYNC;
+    osc->phase += osc->phase_inc * skip;
+    osc->resync = 0u;
+    num_samples -= skip;
+  }
+
+  while (num_samples > 0) {  // Rotate the phasor through the rest
+    unsigned count = num_samples < OSC_BLOCK ? num_samples : OSC_BLOCK;
+    osc_generate(osc, scratch, count);
+    num_samples -= count;
   }
+}
 
+/*
+ * Generate a sine wave of the specified frequency into the specified sample
+ * buffer.
+ * Parameters:
+ *  buf: the pointer to the the sample buffer
+ *  num_samples: the number of samples in the buffer; specifies the duration of
+ *               the rendered audio waveform
+ *  channel: indicates which channel to generate
+ *  freq_hz: the frequency of the generated waveform in Hz (cycles per second)
+ *  amplitude: the relative amplitude of the generated waveform, where 1.0 is 
+ *             the maximum possible amplitude
+ *
+ */
 
-  
+void render_sine_wave(int16_t buf[], unsigned num_samples, unsigned channel,
+		      float freq_hz, float amplitude) {
+  Oscillator osc;
+  osc_init(&osc, freq_hz, amplitude, SINE);
+  osc_render(&osc, buf, num_samples, channel);
 }
 
 /*                                                  
@@ -197,11 +746,9 @@ void render_sine_wave(int16_t buf[], unsigned num_samples, unsigned channel,
  */
 void render_sine_wave_stereo(int16_t buf[], unsigned num_samples,
 			     float freq_hz, float amplitude) {
-
-  render_sine_wave(buf, num_samples, 0, freq_hz, amplitude);
-  render_sine_wave(buf, num_samples, 1, freq_hz, amplitude);
- 
-
+  Oscillator osc;
+  osc_init(&osc, freq_hz, amplitude, SINE);
+  osc_render_stereo(&osc, buf, num_samples, 1.0f, 1.0f);
 }
 
 /*                                                                     
@@ -220,58 +767,9 @@ void render_sine_wave_stereo(int16_t buf[], unsigned num_samples,
 
 void render_square_wave(int16_t buf[], unsigned num_samples, unsigned channel,
 			float freq_hz, float amplitude) {
-  
-  int max = 32768;
-  double time_per_sample = 1.0 / (double) SAMPLES_PER_SECOND;
-  int16_t amp;
-  if (channel == 0) {
-
-    for (unsigned i = 0; i < num_samples * 2; i += 2) {
-      float sineval = (float) (amplitude / 1.0 * max * sin(2 * PI * freq_hz * (i / 2) * time_per_sample));
-      if (sineval >= 0.0f) {
-        amp = (int16_t) (amplitude / 1.0 * max);
-      }
-      else {
-        amp = (int16_t) (-amplitude / 1.0 * max);
-      }
-      
-      if ((int) amp + (int) buf[i] > max) {
-        buf[i] = (int16_t) max;
-      }
-      else if ((int) amp + (int) buf[i] < -max) {
-        buf[i] = (int16_t) -max;
-      }
-      else {
-        buf[i] += amp;
-      }
-
-    }
-  }
-
-  else if (channel == 1) {
-
-    for (unsigned i = 1; i < num_samples * 2; i += 2) {
-      float sineval = (float) (amplitude / 1.0 * max * sin(2 * PI * freq_hz * (i / 2) * time_per_sample));
-      if (sineval >= 0.0f) {
-        amp = (int16_t) (amplitude / 1.0 * max);
-      }
-      else {
-        amp = (int16_t) (-amplitude / 1.0 * max);
-      }
-
-      if ((int) amp + (int) buf[i] > max) {
-        buf[i] = (int16_t) max;
-      }
-      else if ((int) amp + (int) buf[i] < -max) {
-        buf[i] = (int16_t) -max;
-      }
-      else {
-        buf[i] += amp;
-      }
-
-    }
-  }
-
+  Oscillator osc;
+  osc_init(&osc, freq_hz, amplitude, SQUARE);
+  osc_render(&osc, buf, num_samples, channel);
 }
 /*                                                                            
  * Generate a square wave of the specified frequency into the specified stereo
@@ -287,10 +785,9 @@ void render_square_wave(int16_t buf[], unsigned num_samples, unsigned channel,
  */
 void render_square_wave_stereo(int16_t buf[], unsigned num_samples,
 			       float freq_hz, float amplitude) {
-
-  render_square_wave(buf, num_samples, 0, freq_hz, amplitude);
-  render_square_wave(buf, num_samples, 1, freq_hz, amplitude);
-
+  Oscillator osc;
+  osc_init(&osc, freq_hz, amplitude, SQUARE);
+  osc_render_stereo(&osc, buf, num_samples, 1.0f, 1.0f);
 }
 
 /*                                                                            
@@ -308,56 +805,9 @@ void render_square_wave_stereo(int16_t buf[], unsigned num_samples,
  */
 void render_saw_wave(int16_t buf[], unsigned num_samples, unsigned channel,
 		     float freq_hz, float amplitude) {
-
-  int max = 32768;
-  double time_per_sample = 1.0 / (double) SAMPLES_PER_SECOND; 
-  double slope = (double) ((amplitude / 1.0 * max * 2.0) / 1.0);
-  double time_per_cycle = 1.0 / (double) freq_hz;
-  if (channel == 0) {
-
-    for (unsigned i = 0; i < num_samples * 2; i += 2) {
-      double curtime = (i / 2) * time_per_sample;
-      double ratio = curtime / time_per_cycle - (int) (curtime / time_per_cycle);
-      
-      int16_t amp = (int16_t)(-(amplitude / 1.0 * max) +
-			      slope * ratio);
-
-      if ((int) amp + (int) buf[i] > max) {
-        buf[i] = (int16_t) max;
-      }
-      else if ((int) amp + (int) buf[i] < -max) {
-	buf[i] = (int16_t) -max;
-      }
-      else {
-        buf[i] += amp;
-      }
-
-    }
-    
-  }
-  else if (channel == 1) {
-
-    for (unsigned i = 1; i < num_samples * 2; i += 2) {
-      double curtime = (i / 2) * time_per_sample;
-      double ratio = curtime / time_per_cycle - (int) (curtime / time_per_cycle);
-
-      int16_t amp = (int16_t)(-(amplitude / 1.0 * max) + slope * ratio);
-
-      if ((int) amp + (int) buf[i] > max) {
-         buf[i] = (int16_t) max;
-      }
-      else if ((int) amp + (int) buf[i] < -max) {
-        buf[i] = (int16_t) -max;
-      }
-      else {
-        buf[i] += amp;
-      }
-
-    }
-
-
-  }
-    
+  Oscillator osc;
+  osc_init(&osc, freq_hz, amplitude, SAW);
+  osc_render(&osc, buf, num_samples, channel);
 }
 
 /*                                                                            
@@ -374,11 +824,9 @@ void render_saw_wave(int16_t buf[], unsigned num_samples, unsigned channel,
  */
 void render_saw_wave_stereo(int16_t buf[], unsigned num_samples,
 			    float freq_hz, float amplitude) {
-
-  render_saw_wave(buf, num_samples, 0, freq_hz, amplitude);
-  render_saw_wave(buf, num_samples, 1, freq_hz, amplitude);
-
-
+  Oscillator osc;
+  osc_init(&osc, freq_hz, amplitude, SAW);
+  osc_render_stereo(&osc, buf, num_samples, 1.0f, 1.0f);
 }
 
 /*                                                                            
@@ -392,7 +840,8 @@ void render_saw_wave_stereo(int16_t buf[], unsigned num_samples,
  *  freq_hz: the frequency of the generated waveform in Hz (cycles per second) 
  *  amplitude: the relative amplitude of the generated waveform, where 1.0 is 
                the maximum possible amplitude                                 
- *  voice: indicates which waveform to generate                               
+ *  voice: indicates which waveform to generate; the WT_* voices read
+ *         precomputed tables instead of computing each sample
  */
 void render_voice(int16_t buf[], unsigned num_samples, unsigned channel,
 		  float freq_hz, float amplitude, unsigned voice) {
@@ -407,6 +856,14 @@ void render_voice(int16_t buf[], unsigned num_samples, unsigned channel,
     case 2:
       render_saw_wave(buf, num_samples, channel, freq_hz, amplitude);
       break;
+    case WT_SINE:
+    case WT_SQUARE:
+    case WT_SAW: {
+      Oscillator osc;
+      osc_init(&osc, freq_hz, amplitude, voice);
+      osc_render(&osc, buf, num_samples, channel);
+      break;
+    }
     default:
       break;
     }
@@ -427,18 +884,59 @@ void render_voice(int16_t buf[], unsigned num_samples, unsigned channel,
  */
 void render_voice_stereo(int16_t buf[], unsigned num_samples, float freq_hz,
 			 float amplitude, unsigned voice) {
+  render_voice_stereo_pan(buf, num_samples, freq_hz, amplitude, voice, 0.0f);
+}
 
- switch (voice) {
-    case 0:
-      render_sine_wave_stereo(buf, num_samples, freq_hz, amplitude);
-      break;
-    case 1:
-      render_square_wave_stereo(buf, num_samples, freq_hz, amplitude);
-      break;
-    case 2:
-      render_saw_wave_stereo(buf, num_samples, freq_hz, amplitude);
-      break;
-    default:
-      break;
-    }
+/*
+ * Compute the channel gains for a stereo position. Both channels keep
+ * full gain at the centre and the far channel fades out towards the
+ * edges.
+ * Parameters:
+ *  pan: stereo position from -1.0 (left only) to 1.0 (right only); values
+ *       outside that range are clamped
+ *  gain_l: where the left channel gain is stored
+ *  gain_r: where the right channel gain is stored
+ */
+void pan_gains(float pan, float *gain_l, float *gain_r) {
+  if (pan < -1.0f) {
+    pan = -1.0f;
+  }
+  else if (pan > 1.0f) {
+    pan = 1.0f;
+  }
+
+  *gain_l = pan > 0.0f ? 1.0f - pan : 1.0f;
+  *gain_r = pan < 0.0f ? 1.0f + pan : 1.0f;
+}
+
+/*
+ * Generate either a sine wave, a square wave or a saw wave of the specified
+ * frequency into both channels of the specified sample buffer, placed in the
+ * stereo field by pan. Each sample is computed once and written to both
+ * channels in the same pass.
+ * Parameters:
+ *  buf: the pointer to the the sample buffer
+ *  num_samples: the number of samples in the buffer; specifies the duration
+ *               of the rendered audio waveform
+ *  freq_hz: the frequency of the generated waveform in Hz
+ *  amplitude: the relative amplitude of the generated waveform, where 1.0 is
+ *             the maximum possible amplitude
+ *  voice: indicates which waveform to generate
+ *  pan: stereo position from -1.0 (left only) through 0.0 (both channels at
+ *       full amplitude) to 1.0 (right only)
+ */
+void render_voice_stereo_pan(int16_t buf[], unsigned num_samples,
+			     float freq_hz, float amplitude, unsigned voice,
+			     float pan) {
+  Oscillator osc;
+  float gain_l, gain_r;
+
+  if (voice >= NUM_VOICES) {
+    return;
+  }
+
+  pan_gains(pan, &gain_l, &gain_r);
+
+  osc_init(&osc, freq_hz, amplitude, voice);
+  osc_render_stereo(&osc, buf, num_samples, gain_l, gain_r);
 }
@@ -8,15 +8,82 @@
 #define SAMPLES_PER_SECOND 44100u
 #define NUM_CHANNELS       2u
 #define BITS_PER_SAMPLE    16u
+#define WAVE_MAX_CHANNELS  2u /* most channels the renderers mix */
+
+/* format codes of the "fmt " chunk */
+#define WAVE_FORMAT_PCM        0x0001u
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003u
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFEu
+
+/* format of the sample data of a WAVE file */
+typedef struct {
+  uint16_t format;           /* WAVE_FORMAT_PCM or _IEEE_FLOAT; for extensible files the sub-format */
+  uint16_t channels;
+  uint32_t sample_rate;      /* samples per second per channel */
+  uint16_t bits_per_sample;
+  uint16_t block_align;      /* bytes per sample frame */
+  long data_offset;          /* byte offset of the first sample in the file */
+  uint32_t data_size;        /* bytes of sample data the header promises */
+} WaveFormat;
 
 /* voices */
 #define SINE       0
 #define SQUARE     1
 #define SAW        2
-#define NUM_VOICES 3 /* one greater than maximum legal voice */
+#define WT_SINE    3 /* wavetable sine */
+#define WT_SQUARE  4 /* band-limited wavetable square */
+#define WT_SAW     5 /* band-limited wavetable saw */
+#define NUM_VOICES 6 /* one greater than maximum legal voice */
 
+/* phase accumulator oscillator; one full cycle of phase is 2^32 */
+typedef struct {
+  uint32_t phase;      /* current phase */
+  uint32_t phase_inc;  /* phase advance per sample */
+  double amplitude;    /* peak value in sample units */
+  unsigned voice;      /* which waveform to generate */
+  unsigned resync;     /* samples left before the sine phasor is resynced */
+  double sin_val;      /* sine phasor state */
+  double cos_val;
+  double rot_sin;      /* per-sample phasor rotation */
+  double rot_cos;
+  const float *table;  /* wavetable read by the WT_* voices */
+} Oscillator;
+
+void wave_format_init(WaveFormat *format, uint32_t sample_rate,
+  unsigned channels, unsigned bits_per_sample, unsigned code);
+int wave_format_parse(const char *spec, WaveFormat *format);
+void write_wave_format(FILE *out, const WaveFormat *format,
+  unsigned num_frames);
+void wave_encode(const WaveFormat *format, uint8_t dst[], const float bus[],
+  unsigned num_values, int dither, uint32_t seed);
 void write_wave_header(FILE *out, unsigned num_samples);
 void read_wave_header(FILE *in, unsigned *num_samples);
+void read_wave_format(FILE *in, WaveFormat *format);
+
+void osc_init(Oscillator *osc, float freq_hz, float amplitude,
+  unsigned voice);
+void osc_init_rate(Oscillator *osc, float freq_hz, float amplitude,
+  unsigned voice, uint32_t sample_rate);
+
+void osc_render(Oscillator *osc, int16_t buf[], unsigned num_samples,
+  unsigned channel);
+
+void osc_render_stereo(Oscillator *osc, int16_t buf[], unsigned num_samples,
+  float gain_l, float gain_r);
+
+void osc_mix_stereo(Oscillator *osc, float bus[], unsigned num_samples,
+  float gain_l, float gain_r);
+
+void osc_mix_mono(Oscillator *osc, float bus[], unsigned num_samples,
+  float gain);
+
+void osc_mix(Oscillator *osc, float bus[], unsigned num_samples,
+  unsigned channels, float gain_l, float gain_r);
+
+void osc_mix_env(Oscillator *osc, float bus[], unsigned num_samples,
+  unsigned channels, float gain_l, float gain_r, const float env[]);
+
+void osc_seek(Oscillator *osc, unsigned num_samples);
 
 void render_sine_wave(int16_t buf[], unsigned num_samples, unsigned channel,
   float freq_hz, float amplitude);
@@ -42,4 +109,9 @@ void render_voice(int16_t buf[], unsigned num_samples, unsigned channel,
 void render_voice_stereo(int16_t buf[], unsigned num_samples, float freq_hz,
   float amplitude, unsigned voice);
 
+void pan_gains(float pan, float *gain_l, float *gain_r);
+
+void render_voice_stereo_pan(int16_t buf[], unsigned num_samples,
+  float freq_hz, float amplitude, unsigned voice, float pan);
+
 #endif /* WAVE_H */
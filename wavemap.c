@@ -0,0 +1,129 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "io.h"
+#include "wavemap.h"
+
+/*
+ * Return the file descriptor and byte offset of a stream positioned
+ * at the start of sample data, or -1 if the stream is not a regular
+ * file whose samples can be viewed in place (pipes, devices, big
+ * endian hosts or odd offsets).
+ */
+static int mappable_fd(FILE *stream, off_t *offset, struct stat *info) {
+  if (!host_is_little_endian()) {  // The view must already be in file byte order
+    return -1;
+  }
+
+  if (fflush(stream) != 0) {
+    return -1;
+  }
+  int fd = fileno(stream);
+  *offset = ftello(stream);
+  if (fd < 0 || *offset < 0 || *offset % 2 != 0) {
+    return -1;
+  }
+  if (fstat(fd, info) != 0 || !S_ISREG(info->st_mode)) {
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * Map the sample data of a WAVE file for reading. Call after
+ * read_wave_header, while in is positioned at the first sample; the
+ * stream position is not changed. If the file holds fewer samples
+ * than num_samples, the view is shortened to what is there.
+ * Parameters:
+ *  in: the input stream
+ *  num_samples: the number of (stereo) samples the header promises
+ *  map: where the view is stored
+ * Returns 1 if the data was mapped and 0 if the caller should stream
+ * it instead.
+ */
+int wavemap_input(FILE *in, unsigned num_samples, WaveMap *map) {
+  struct stat info;
+  off_t offset;
+  int fd = mappable_fd(in, &offset, &info);
+  if (fd < 0 || info.st_size <= offset) {
+    return 0;
+  }
+
+  void *base = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    return 0;
+  }
+
+  unsigned available = (unsigned) ((info.st_size - offset) / 4);
+  map->base = base;
+  map->length = (size_t) info.st_size;
+  map->samples = (int16_t *) ((char *) base + offset);
+  map->num_samples = available < num_samples ? available : num_samples;
+  return 1;
+}
+
+/*
+ * Size a WAVE file for num_samples samples and map its sample data
+ * for writing. Call after write_wave_header, while out is positioned
+ * at the first sample. Space is reserved with posix_fallocate where
+ * the file system supports it, so running out of disk is reported
+ * here rather than as a fault while writing through the view.
+ * Parameters:
+ *  out: the output stream
+ *  num_samples: the number of (stereo) samples to make room for
+ *  map: where the view is stored
+ * Returns 1 if the data was mapped and 0 if the caller should stream
+ * it instead; the file is left as it was in that case.
+ */
+int wavemap_output(FILE *out, unsigned num_samples, WaveMap *map) {
+  struct stat info;
+  off_t offset;
+  int fd = mappable_fd(out, &offset, &info);
+  if (fd < 0 || num_samples == 0) {
+    return 0;
+  }
+
+  off_t length = offset + (off_t) num_samples * 4;
+  int err = posix_fallocate(fd, 0, length);
+  if (err == EINVAL || err == EOPNOTSUPP) {  // File system can't reserve space, just set the size
+    err = ftruncate(fd, length) == 0 ? 0 : errno;
+  }
+  if (err != 0) {
+    if (ftruncate(fd, info.st_size) != 0) {
+      fatal_error("Cannot restore output file size");
+    }
+    return 0;
+  }
+
+  void *base = mmap(NULL, (size_t) length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    if (ftruncate(fd, info.st_size) != 0) {
+      fatal_error("Cannot restore output file size");
+    }
+    return 0;
+  }
+
+  map->base = base;
+  map->length = (size_t) length;
+  map->samples = (int16_t *) ((char *) base + offset);
+  map->num_samples = num_samples;
+  return 1;
+}
+
+/*
+ * Unmap a view. Data written through an output view reaches the file
+ * like any other write to it.
+ */
+void wavemap_close(WaveMap *map) {
+  munmap(map->base, map->length);
+  map->base = NULL;
+  map->samples = NULL;
+  map->num_samples = 0;
+}
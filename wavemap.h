@@ -0,0 +1,20 @@
+#ifndef WAVEMAP_H
+#define WAVEMAP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* memory mapped view of the sample data of a WAVE file */
+typedef struct {
+  void *base;            /* start of the mapping */
+  size_t length;         /* bytes mapped */
+  int16_t *samples;      /* interleaved stereo samples of the data chunk */
+  unsigned num_samples;  /* (stereo) samples in the view */
+} WaveMap;
+
+int wavemap_input(FILE *in, unsigned num_samples, WaveMap *map);
+int wavemap_output(FILE *out, unsigned num_samples, WaveMap *map);
+void wavemap_close(WaveMap *map);
+
+#endif /* WAVEMAP_H */
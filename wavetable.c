@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include "wave.h"
+#include "wavetable.h"
+
+/*
+ * Each table holds one cycle plus a copy of its first sample, so
+ * linear interpolation never has to wrap the index.
+ * Band-limited level k holds (WT_SIZE / 2 - 1) >> k harmonics,
+ * from 1023 at level 0 down to a single harmonic at the last level.
+ */
+static float sine_table[WT_SIZE + 1];
+static float square_tables[WT_NUM_LEVELS][WT_SIZE + 1];
+static float saw_tables[WT_NUM_LEVELS][WT_SIZE + 1];
+static int tables_ready = 0;
+
+/*
+ * Return the number of harmonics stored at band-limited level k.
+ */
+static unsigned level_harmonics(unsigned level) {
+  return (WT_SIZE / 2u - 1u) >> level;
+}
+
+/*
+ * Fill table[] with one cycle of a waveform built by summing
+ * harmonics 1..num_harmonics of the sine table, where harmonic k
+ * has weight weight(k) (zero weights are skipped). The result is
+ * scaled so that its peak is 1.0.
+ */
+static void build_table(float table[], unsigned num_harmonics,
+			double (*weight)(unsigned)) {
+  double sum[WT_SIZE];
+  double peak = 0.0;
+
+  for (unsigned i = 0; i < WT_SIZE; i++) {
+    sum[i] = 0.0;
+  }
+
+  for (unsigned k = 1; k <= num_harmonics; k++) {
+    double w = weight(k);
+    if (w == 0.0) {
+      continue;
+    }
+    for (unsigned i = 0; i < WT_SIZE; i++) {  // sin(k * x) is the sine table at k * i
+      sum[i] += w * sine_table[(k * i) & (WT_SIZE - 1u)];
+    }
+  }
+
+  for (unsigned i = 0; i < WT_SIZE; i++) {
+    peak = fabs(sum[i]) > peak ? fabs(sum[i]) : peak;
+  }
+  for (unsigned i = 0; i < WT_SIZE; i++) {
+    table[i] = (float) (peak > 0.0 ? sum[i] / peak : 0.0);
+  }
+  table[WT_SIZE] = table[0];
+}
+
+/*
+ * Fourier weight of harmonic k in a square wave that is high for
+ * the first half of its cycle.
+ */
+static double square_weight(unsigned k) {
+  return (k % 2u == 1u) ? 4.0 / (PI * k) : 0.0;
+}
+
+/*
+ * Fourier weight of harmonic k in a saw wave that ramps from -1
+ * up to 1 over its cycle.
+ */
+static double saw_weight(unsigned k) {
+  return -2.0 / (PI * k);
+}
+
+/*
+ * Build the sine table and the band-limited square and saw tables.
+ * Only the first call does any work. Programs that render from
+ * several threads must call this before starting them.
+ */
+void wavetable_init(void) {
+  if (tables_ready) {
+    return;
+  }
+
+  for (unsigned i = 0; i < WT_SIZE; i++) {
+    sine_table[i] = (float) sin(2.0 * PI * i / WT_SIZE);
+  }
+  sine_table[WT_SIZE] = sine_table[0];
+
+  for (unsigned level = 0; level < WT_NUM_LEVELS; level++) {
+    build_table(square_tables[level], level_harmonics(level), square_weight);
+    build_table(saw_tables[level], level_harmonics(level), saw_weight);
+  }
+
+  tables_ready = 1;
+}
+
+/*
+ * Return the table to read for a voice at the given frequency,
+ * expressed in cycles per sample. Square and saw voices get the
+ * richest level whose harmonics all stay below the Nyquist
+ * frequency, so high notes do not alias.
+ * Parameters:
+ *  voice: SINE, SQUARE or SAW
+ *  cycles_per_sample: the oscillator frequency divided by the sample rate
+ */
+const float *wavetable_lookup(unsigned voice, double cycles_per_sample) {
+  unsigned level = 0;
+
+  wavetable_init();
+
+  if (voice == SINE) {
+    return sine_table;
+  }
+
+  /* harmonic k sits at k * cycles_per_sample and must stay below 0.5 */
+  while (level + 1u < WT_NUM_LEVELS &&
+	 level_harmonics(level) * cycles_per_sample >= 0.5) {
+    level++;
+  }
+
+  return voice == SQUARE ? square_tables[level] : saw_tables[level];
+}
@@ -0,0 +1,13 @@
+#ifndef WAVETABLE_H
+#define WAVETABLE_H
+
+#include <stdint.h>
+
+#define WT_BITS       11u                /* log2 of the table length */
+#define WT_SIZE       (1u << WT_BITS)    /* samples per table cycle */
+#define WT_NUM_LEVELS 10u                /* band-limited tables per waveform */
+
+void wavetable_init(void);
+const float *wavetable_lookup(unsigned voice, double cycles_per_sample);
+
+#endif /* WAVETABLE_H */